@@ -0,0 +1,83 @@
+#include "comp.h"
+
+#define ARENA_ALIGN 8
+
+/*
+ * Bump-pointer allocator. Blocks come zeroed from calloc and are
+ * only given back all at once by arena_release.
+ */
+
+void arena_init(struct arena **arena, const char* name, size_t blk_size) {
+	struct arena *a = calloc(1, sizeof(struct arena));
+	a->name = name;
+	a->blk_size = blk_size;
+	a->blk = NULL;
+	*arena = a;
+}
+
+struct arena_blk *arena_grow(struct arena *a, size_t size) {
+	size_t cap = size > a->blk_size ? size : a->blk_size;
+	struct arena_blk *blk = calloc(1, sizeof(struct arena_blk) + cap);
+	blk->size = cap;
+	blk->used = 0;
+	blk->prev = a->blk;
+	a->blk = blk;
+	a->blocks += 1;
+	a->reserved += cap;
+	return blk;
+}
+
+void* arena_alloc(struct arena *a, size_t size) {
+	struct arena_blk *blk = a->blk;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (blk == NULL || blk->size - blk->used < size)
+		blk = arena_grow(a, size);
+	void* res = blk->data + blk->used;
+	blk->used += size;
+	a->used += size;
+	return res;
+}
+
+void arena_release(struct arena *a) {
+	struct arena_blk *blk = a->blk, *prev;
+	while (blk != NULL) {
+		prev = blk->prev;
+		free(blk);
+		blk = prev;
+	}
+	free(a);
+}
+
+/*
+ * Empties the arena for reuse. Only the largest block is kept, cleared
+ * so allocations still come back zeroed.
+ */
+void arena_reset(struct arena *a) {
+	struct arena_blk *blk = a->blk, *prev, *keep = NULL;
+	while (blk != NULL) {
+		prev = blk->prev;
+		if (keep == NULL || blk->size > keep->size) {
+			if (keep != NULL)
+				free(keep);
+			keep = blk;
+		} else
+			free(blk);
+		blk = prev;
+	}
+	a->blk = keep;
+	a->used = 0;
+	a->blocks = 0;
+	a->reserved = 0;
+	if (keep != NULL) {
+		memset(keep->data, 0, keep->used);
+		keep->used = 0;
+		keep->prev = NULL;
+		a->blocks = 1;
+		a->reserved = keep->size;
+	}
+}
+
+void arena_report(struct arena *a, FILE* fp) {
+	fprintf(fp, "arena %-6s %12zu bytes used %12zu reserved %6zu blocks\n",
+			a->name, a->used, a->reserved, a->blocks);
+}
@@ -0,0 +1,187 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "comp.h"
+
+#define AST_MAGIC 0x54534163u
+#define AST_VERSION 1
+
+/*
+ * Parsed programs on disk. The pool is written as is, since nodes only
+ * refer to each other and to symbols by index, followed by the roots,
+ * one record per symbol and the symbol names:
+ *
+ *   ast_hdr | nodes | roots | ast_sym records | names
+ *
+ * Loading maps the file privately and uses the nodes in place; the
+ * layout pass writes stack offsets into them, which only touches our
+ * copy of those pages. Files are in host byte order.
+ */
+
+struct ast_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nodes;
+	uint32_t roots;
+	uint32_t syms;
+	uint32_t names;
+	uint32_t pad[2];
+};
+
+struct ast_sym {
+	uint32_t name;
+	uint8_t type;
+	uint8_t ret_type;
+	uint8_t func;
+	uint8_t pad;
+};
+
+void ast_file_err(const char* what) {
+	fprintf(diag_stream(), "Bad AST file (%s)\n", what);
+	compile_fail();
+}
+
+void ast_write_err(const char* path) {
+	fprintf(diag_stream(), "Cannot write AST file %s\n", path);
+	compile_fail();
+}
+
+int ast_save(struct context *ctx, const char* path) {
+	struct ast_hdr hdr = { AST_MAGIC, AST_VERSION, ctx->ast->len,
+		ctx->asts->len, ctx->symbols->len, 0 };
+	struct ast_sym rec = { 0 };
+	struct sym_ent *se;
+	FILE* fp;
+	for (size_t i = 0; i < ctx->symbols->len; ++i)
+		hdr.names += strlen(ctx->symbols->buff[i]->name) + 1;
+	if ((fp = fopen(path, "wb")) == NULL)
+		ast_write_err(path);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(ctx->ast->buff, sizeof(struct ast_node), ctx->ast->len, fp);
+	fwrite(ctx->asts->buff, sizeof(uint32_t), ctx->asts->len, fp);
+	for (size_t i = 0; i < ctx->symbols->len; ++i) {
+		se = ctx->symbols->buff[i];
+		rec.type = se->type;
+		rec.ret_type = se->ret_type;
+		rec.func = se->func;
+		fwrite(&rec, sizeof(rec), 1, fp);
+		rec.name += strlen(se->name) + 1;
+	}
+	for (size_t i = 0; i < ctx->symbols->len; ++i) {
+		se = ctx->symbols->buff[i];
+		fwrite(se->name, 1, strlen(se->name) + 1, fp);
+	}
+	if (fclose(fp) != 0)
+		ast_write_err(path);
+	return 0;
+}
+
+/*
+ * Every index a node holds is checked against the file, so a damaged
+ * file is refused here instead of being followed by code generation.
+ */
+int ast_check(struct ast_hdr *hdr, struct ast_node *nodes, uint32_t *roots,
+		struct ast_sym *syms, char* names) {
+	struct ast_node *node;
+	for (uint32_t i = 0; i < hdr->nodes; ++i) {
+		node = &nodes[i];
+		switch (node->type) {
+			case AST_VAR:
+				if (node->sym >= hdr->syms)
+					return -1;
+				break;
+			// operands come before the node that uses them
+			case AST_ASS:
+				if (node->sym >= hdr->syms || node->right >= i)
+					return -1;
+				break;
+			case AST_CALL:
+				if (node->sym >= hdr->syms || node->first >= i)
+					return -1;
+				break;
+			case AST_FUNC:
+				if (node->sym >= hdr->syms)
+					return -1;
+				// fall through
+			case AST_ARGS:
+				if (node->end <= i || node->end > hdr->nodes)
+					return -1;
+				break;
+			case AST_OP:
+				if (node->left >= i || node->right >= i)
+					return -1;
+				break;
+			case AST_INT:
+			case AST_SKIP:
+				break;
+			default:
+				return -1;
+		}
+	}
+	for (uint32_t i = 0; i < hdr->roots; ++i)
+		if (roots[i] >= hdr->nodes)
+			return -1;
+	for (uint32_t i = 0; i < hdr->syms; ++i)
+		if (syms[i].name >= hdr->names)
+			return -1;
+	return hdr->names && names[hdr->names - 1] != '\0' ? -1 : 0;
+}
+
+int ast_load(struct context *ctx, FILE *fp) {
+	struct ast_hdr *hdr;
+	struct ast_node *nodes;
+	struct ast_sym *syms;
+	struct sym_ent *se;
+	struct src_buf *map;
+	struct stat st;
+	uint32_t *roots;
+	char* names;
+	size_t need;
+	int fd = fileno(fp);
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+			|| (size_t)st.st_size < sizeof(struct ast_hdr))
+		ast_file_err("size");
+	map = calloc(1, sizeof(struct src_buf));
+	map->size = st.st_size;
+	map->data = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+	if (map->data == MAP_FAILED) {
+		free(map);
+		ast_file_err("mmap");
+	}
+	map->mapped = 1;
+	ctx->src = map;
+	hdr = (struct ast_hdr *)map->data;
+	need = sizeof(struct ast_hdr) + (size_t)hdr->nodes * sizeof(struct ast_node)
+		+ (size_t)hdr->roots * sizeof(uint32_t)
+		+ (size_t)hdr->syms * sizeof(struct ast_sym) + hdr->names;
+	if (hdr->magic != AST_MAGIC || hdr->version != AST_VERSION
+			|| need != map->size)
+		ast_file_err("header");
+	nodes = (struct ast_node *)(hdr + 1);
+	roots = (uint32_t *)(nodes + hdr->nodes);
+	syms = (struct ast_sym *)(roots + hdr->roots);
+	names = (char*)(syms + hdr->syms);
+	if (ast_check(hdr, nodes, roots, syms, names) == -1)
+		ast_file_err("index out of range");
+
+	ctx->ast = calloc(1, sizeof(struct ast_pool));
+	ctx->ast->buff = nodes;
+	ctx->ast->len = ctx->ast->cap = hdr->nodes;
+	ctx->ast_mapped = 1;
+	idx_vec_init(&ctx->asts, hdr->roots);
+	memcpy(ctx->asts->buff, roots, hdr->roots * sizeof(uint32_t));
+	ctx->asts->len = hdr->roots;
+	if (ctx->parse_arena == NULL)
+		arena_init(&ctx->parse_arena, "parse", 1 << 20);
+	sym_vec_init(&ctx->symbols, hdr->syms);
+	for (uint32_t i = 0; i < hdr->syms; ++i) {
+		se = arena_alloc(ctx->parse_arena, sizeof(struct sym_ent));
+		se->name = names + syms[i].name;
+		se->type = syms[i].type;
+		se->ret_type = syms[i].ret_type;
+		se->func = syms[i].func;
+		se->id = i;
+		sym_vec_push(ctx->symbols, se);
+	}
+	return 0;
+}
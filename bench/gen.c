@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Writes a random program of n functions to stdout. Each declares a
+ * few locals from random expressions over its earlier locals and calls
+ * to earlier functions; main calls the last one. The same n and seed
+ * always give the same program.
+ *
+ *   gen n [seed]
+ */
+
+static uint64_t state;
+
+uint32_t rnd(uint32_t bound) {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state % bound;
+}
+
+void expr(int fn, int vars, int depth) {
+	static const char ops[] = "+-*/+-*";
+	char op;
+	if (depth > 4 || rnd(10) < 3) {
+		uint32_t c = rnd(10);
+		if (vars && c < 5)
+			printf("v%dx%u", fn, rnd(vars));
+		else if (fn && c < 6)
+			printf("fn%u()", rnd(fn));
+		else
+			printf("%u", rnd(100));
+		return;
+	}
+	op = ops[rnd(sizeof(ops) - 1)];
+	if (op == '/') {
+		printf("(");
+		expr(fn, vars, depth + 1);
+		printf(") / %u", rnd(9) + 1);
+		return;
+	}
+	int paren = rnd(2);
+	if (paren)
+		printf("(");
+	expr(fn, vars, depth + 1);
+	printf(" %c ", op);
+	expr(fn, vars, depth + 1);
+	if (paren)
+		printf(")");
+}
+
+int main(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000;
+	state = argc > 2 ? strtoull(argv[2], NULL, 10) * 2654435761u + 1 : 1;
+	for (int i = 0; i < n; ++i) {
+		int vars = rnd(8) + 1;
+		printf("int fn%d() {\n", i);
+		for (int j = 0; j < vars; ++j) {
+			printf("\tint v%dx%d = ", i, j);
+			expr(i, j, 0);
+			printf(";\n");
+		}
+		printf("\treturn ");
+		expr(i, vars, 0);
+		printf(";\n}\n");
+	}
+	printf("int main() {\n\tint r = fn%d();\n\treturn r;\n}\n", n - 1);
+	return 0;
+}
@@ -0,0 +1,162 @@
+#include <time.h>
+#include "../comp.h"
+
+/*
+ * Symbol table micro-benchmark: one insert and one lookup per key, for
+ * the Robin Hood table in hashtable.c and for the chained table it
+ * replaced, kept here as it was. Keys are distinct strings whose
+ * address is their identity, as interned names are.
+ *
+ *   ht_bench [-r] [keys...]
+ *
+ * -r skips the chained table, which takes minutes at 1M keys.
+ */
+
+struct chain_node {
+	char* key;
+	void* val;
+	struct chain_node *next;
+};
+
+struct chain_tab {
+	struct chain_node **eles;
+	size_t buckets;
+	size_t count;
+	float bound;
+};
+
+void chain_init(struct chain_tab *ht, size_t buckets, float bound) {
+	ht->eles = calloc(buckets, sizeof(struct chain_node *));
+	ht->buckets = buckets;
+	ht->bound = bound;
+	ht->count = 0;
+}
+
+// djb2 truncated to a byte, as the old table had it
+uint8_t chain_hash(struct chain_tab *ht, char* val) {
+	uint32_t hash = 5381;
+	uint8_t c;
+	while ((c = *val++))
+		hash = ((hash << 5) + hash) + c;
+	return hash % ht->buckets;
+}
+
+void chain_insert(struct chain_tab *ht, char* key, void* val);
+
+void chain_grow(struct chain_tab *ht) {
+	struct chain_tab new_ht;
+	struct chain_node *node, *next;
+	chain_init(&new_ht, ht->buckets * 2, ht->bound);
+	for (size_t i = 0; i < ht->buckets; ++i) {
+		for (node = ht->eles[i]; node != NULL; node = next) {
+			next = node->next;
+			chain_insert(&new_ht, node->key, node->val);
+			free(node);
+		}
+	}
+	free(ht->eles);
+	*ht = new_ht;
+}
+
+void chain_insert(struct chain_tab *ht, char* key, void* val) {
+	struct chain_node *node;
+	uint8_t hash;
+	if (((float)ht->count + 1) / ht->buckets > ht->bound)
+		chain_grow(ht);
+	hash = chain_hash(ht, key);
+	node = calloc(1, sizeof(struct chain_node));
+	node->key = key;
+	node->val = val;
+	node->next = ht->eles[hash];
+	ht->eles[hash] = node;
+	ht->count += 1;
+}
+
+void* chain_find(struct chain_tab *ht, char* key) {
+	struct chain_node *node = ht->eles[chain_hash(ht, key)];
+	for (; node != NULL; node = node->next)
+		if (!strcmp(node->key, key))
+			return node->val;
+	return NULL;
+}
+
+void chain_destroy(struct chain_tab *ht) {
+	struct chain_node *node, *next;
+	for (size_t i = 0; i < ht->buckets; ++i) {
+		for (node = ht->eles[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(ht->eles);
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_robin(char** keys, size_t n) {
+	struct arena *arena;
+	struct hashtable *ht;
+	size_t found = 0;
+	double start;
+	arena_init(&arena, "bench", 1 << 16);
+	start = now();
+	ht_init(&ht, arena, 100, 0.75f);
+	for (size_t i = 0; i < n; ++i)
+		ht_insert(ht, keys[i], keys[i]);
+	for (size_t i = 0; i < n; ++i)
+		found += ht_find(ht, keys[i]) == keys[i];
+	start = now() - start;
+	if (found != n)
+		fprintf(stderr, "robin hood lost %zu keys\n", n - found);
+	arena_release(arena);
+	return start;
+}
+
+double bench_chained(char** keys, size_t n) {
+	struct chain_tab ht;
+	size_t found = 0;
+	double start = now();
+	chain_init(&ht, 100, 0.75f);
+	for (size_t i = 0; i < n; ++i)
+		chain_insert(&ht, keys[i], keys[i]);
+	for (size_t i = 0; i < n; ++i)
+		found += chain_find(&ht, keys[i]) == keys[i];
+	start = now() - start;
+	if (found != n)
+		fprintf(stderr, "chained lost %zu keys\n", n - found);
+	chain_destroy(&ht);
+	return start;
+}
+
+void run(size_t n, int robin_only) {
+	char** keys = malloc(n * sizeof(char*));
+	char name[32];
+	for (size_t i = 0; i < n; ++i) {
+		snprintf(name, sizeof(name), "sym%zu", i);
+		keys[i] = strdup(name);
+	}
+	printf("%8zu keys: robin hood %.4fs", n, bench_robin(keys, n));
+	if (!robin_only)
+		printf(", chained %.4fs", bench_chained(keys, n));
+	printf("\n");
+	for (size_t i = 0; i < n; ++i)
+		free(keys[i]);
+	free(keys);
+}
+
+int main(int argc, char **argv) {
+	int robin_only = argc > 1 && !strcmp(argv[1], "-r");
+	int first = 1 + robin_only;
+	if (first == argc) {
+		run(1000, robin_only);
+		run(100000, robin_only);
+		run(1000000, robin_only);
+	}
+	for (int i = first; i < argc; ++i)
+		run((size_t)atol(argv[i]), robin_only);
+	return 0;
+}
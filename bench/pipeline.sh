@@ -0,0 +1,30 @@
+#!/bin/sh
+# Times the sequential, --stream and --pipeline front ends on one
+# generated input and checks they emit the same assembly.
+#
+#   bench/pipeline.sh [functions] [runs]
+#
+# Run from the repository root after `make bench`.
+n=${1:-100000}
+runs=${2:-2}
+comp=./build/compiler
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+./build/gen "$n" > "$tmp/in.c" || exit 1
+echo "$n functions, $(wc -c < "$tmp/in.c") bytes"
+for mode in "" --stream --pipeline; do
+	i=0
+	while [ $i -lt "$runs" ]; do
+		start=$(date +%s.%N)
+		$comp $mode "$tmp/in.c" > "$tmp/out$mode.s" || exit 1
+		end=$(date +%s.%N)
+		awk -v m="${mode:-sequential}" -v s="$start" -v e="$end" \
+			'BEGIN { printf "%-12s %8.3f s\n", m, e - s }'
+		i=$((i + 1))
+	done
+	if ! cmp -s "$tmp/out.s" "$tmp/out$mode.s"; then
+		echo "${mode:-sequential}: output differs" >&2
+		exit 1
+	fi
+done
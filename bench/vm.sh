@@ -0,0 +1,45 @@
+#!/bin/sh
+# Times --run against --interp on a call-heavy chain, where f24 makes
+# 2^25 calls, and on two generated programs, and checks both print the
+# same result.
+#
+#   bench/vm.sh [runs]
+#
+# Run from the repository root after `make bench`.
+runs=${1:-3}
+comp=./build/compiler
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+{
+	echo "int f0() { return 1; }"
+	i=1
+	while [ $i -lt 25 ]; do
+		echo "int f$i() { int a$i = f$((i - 1))() + f$((i - 1))(); return a$i; }"
+		i=$((i + 1))
+	done
+	echo "int main() { int r = f24(); return r; }"
+} > "$tmp/calls.c"
+./build/gen 20000 > "$tmp/g20k.c" || exit 1
+./build/gen 100000 > "$tmp/g100k.c" || exit 1
+
+for prog in calls:f24 g20k:fn0 g100k:fn0; do
+	name=${prog%:*}
+	entry=${prog#*:}
+	for mode in --run --interp; do
+		i=0
+		while [ $i -lt "$runs" ]; do
+			start=$(date +%s.%N)
+			$comp $mode --entry "$entry" "$tmp/$name.c" \
+				> "$tmp/$name$mode" || exit 1
+			end=$(date +%s.%N)
+			awk -v p="$name" -v m="$mode" -v s="$start" -v e="$end" \
+				'BEGIN { printf "%-6s %-9s %8.3f s\n", p, m, e - s }'
+			i=$((i + 1))
+		done
+	done
+	if ! cmp -s "$tmp/$name--run" "$tmp/$name--interp"; then
+		echo "$name: results differ" >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,273 @@
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include "comp.h"
+
+#define CACHE_MAGIC 0x33636e66u
+#define FNV_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/*
+ * Function-level incremental compilation. Each function body gets a
+ * key from its tokens and from whatever it refers to outside itself;
+ * a hit replays the text emitted for it last time without parsing the
+ * body. Top-level code is small and always compiled.
+ *
+ * An entry is the header, then where each of the body's locals sits
+ * above the entry stack, then the text. Later bodies may read those
+ * locals, so a hit has to place them as emitting the body would.
+ */
+
+struct cache_hdr {
+	uint32_t magic;
+	uint32_t locals;
+	uint64_t key;
+	uint64_t delta;
+	uint64_t size;
+};
+
+struct cache_file {
+	char* name;
+	size_t size;
+	struct timespec used;
+};
+
+static inline uint64_t fnv(uint64_t h, const void* data, size_t size) {
+	const uint8_t *p = data;
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return h;
+}
+
+/*
+ * Besides the tokens, every name in the body is keyed by what it
+ * resolves to: one declared further down by that alone, a function by
+ * its arity, a variable by how far below the entry stack it sits.
+ */
+uint64_t cache_key(struct context *ctx, struct func_body *body,
+		uint64_t stack) {
+	struct tok_stream *ts = ctx->tokens;
+	struct intern_ent *name;
+	struct sym_ent *se;
+	uint64_t h = FNV_BASIS, val;
+	uint32_t kind;
+	int num;
+	char c;
+	h = fnv(h, body->se->name, strlen(body->se->name) + 1);
+	for (size_t i = body->start; i < body->end; ++i) {
+		kind = ts_type(ts, i);
+		h = fnv(h, &kind, sizeof(kind));
+		switch (kind) {
+			case TK_TEXT:
+				name = ts_name(ts, i);
+				h = fnv(h, name->str, name->len + 1);
+				se = ht_find(ctx->syms, name->str);
+				if (se == NULL)
+					val = 0;
+				else if (se->decl > body->start)
+					val = 2;
+				else if (se->func)
+					val = 1 | (uint64_t)se->params->count << 8;
+				else
+					val = 3 | (stack - se->stack) << 8;
+				h = fnv(h, &val, sizeof(val));
+				break;
+			case TK_INT:
+				num = ts_int(ts, i);
+				h = fnv(h, &num, sizeof(num));
+				break;
+			case TK_OP:
+				c = ts_char(ts, i);
+				h = fnv(h, &c, 1);
+				break;
+		}
+	}
+	return h;
+}
+
+void cache_path(struct fn_cache *cache, uint64_t key, char* path,
+		size_t size) {
+	snprintf(path, size, "%s/%016llx", cache->dir, (unsigned long long)key);
+}
+
+/*
+ * Reads the entry for key into a malloc'd buffer and the offsets of
+ * its count locals into stacks. A hit bumps the file's mtime, which
+ * eviction uses as its last use.
+ */
+int cache_get(struct fn_cache *cache, uint64_t key, char** text,
+		size_t *size, uint64_t *delta, uint64_t *stacks, uint32_t count) {
+	struct cache_hdr hdr;
+	char path[4096];
+	FILE* fp;
+	cache_path(cache, key, path, sizeof(path));
+	if ((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CACHE_MAGIC
+			|| hdr.key != key || hdr.locals != count
+			|| fread(stacks, sizeof(uint64_t), count, fp) != count) {
+		fclose(fp);
+		return -1;
+	}
+	*text = malloc(hdr.size ? hdr.size : 1);
+	if (fread(*text, 1, hdr.size, fp) != hdr.size) {
+		free(*text);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	*size = hdr.size;
+	*delta = hdr.delta;
+	utime(path, NULL);
+	return 0;
+}
+
+/*
+ * Written under a temporary name and renamed into place, so readers
+ * in other processes never see half an entry.
+ */
+void cache_put(struct fn_cache *cache, uint64_t key, const char* text,
+		size_t size, uint64_t delta, uint64_t *stacks, uint32_t count) {
+	struct cache_hdr hdr = { CACHE_MAGIC, count, key, delta, size };
+	char tmp[4096], path[4096];
+	FILE* fp;
+	int fd;
+	snprintf(tmp, sizeof(tmp), "%s/.tmpXXXXXX", cache->dir);
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	fp = fdopen(fd, "wb");
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+			|| fwrite(stacks, sizeof(uint64_t), count, fp) != count
+			|| fwrite(text, 1, size, fp) != size) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+	cache_path(cache, key, path, sizeof(path));
+	if (rename(tmp, path) == -1)
+		unlink(tmp);
+	else
+		cache->stored++;
+}
+
+int cache_file_cmp(const void* a, const void* b) {
+	const struct cache_file *fa = a, *fb = b;
+	if (fa->used.tv_sec != fb->used.tv_sec)
+		return fa->used.tv_sec < fb->used.tv_sec ? -1 : 1;
+	return (fa->used.tv_nsec > fb->used.tv_nsec)
+		- (fa->used.tv_nsec < fb->used.tv_nsec);
+}
+
+/*
+ * Deletes least recently used entries until the cache fits its limit.
+ */
+void cache_evict(struct fn_cache *cache) {
+	struct cache_file *files = NULL;
+	size_t count = 0, cap = 0, total = 0;
+	struct dirent *ent;
+	struct stat st;
+	char path[4096];
+	DIR* dir = opendir(cache->dir);
+	if (dir == NULL)
+		return;
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		if (count == cap) {
+			cap = cap ? cap * 2 : 256;
+			files = realloc(files, cap * sizeof(struct cache_file));
+		}
+		files[count].name = strdup(ent->d_name);
+		files[count].size = st.st_size;
+		files[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+	qsort(files, count, sizeof(struct cache_file), cache_file_cmp);
+	for (size_t i = 0; i < count; ++i) {
+		if (total > cache->limit) {
+			snprintf(path, sizeof(path), "%s/%s", cache->dir, files[i].name);
+			if (unlink(path) == 0) {
+				total -= files[i].size;
+				cache->evicted++;
+			}
+		}
+		free(files[i].name);
+	}
+	free(files);
+}
+
+/*
+ * The top level is parsed with bodies deferred, then emitted in
+ * order. A function's key depends on the stack at its entry, so each
+ * one is looked up only once everything before it has been emitted.
+ */
+int incremental(struct context *ctx, FILE *fp, char* dir, size_t limit) {
+	struct fn_cache *cache;
+	struct body_vec *bodies;
+	struct ast_pool *ast, *body_ast;
+	struct idx_vec *roots;
+	struct func_body *body;
+	uint32_t start = 0, stop, root, count;
+	uint64_t key, delta, entry, *stacks;
+	size_t size;
+	char* text;
+	if (scan(ctx, fp) == -1)
+		return -1;
+	cache = calloc(1, sizeof(struct fn_cache));
+	cache->dir = dir;
+	cache->limit = limit;
+	ctx->cache = cache;
+	mkdir(dir, 0777);
+	if ((bodies = parse_signatures(ctx)) == NULL)
+		return out(ctx);
+	ast = ctx->ast;
+	roots = ctx->asts;
+	out_begin(ctx);
+	for (size_t i = 0; i < roots->len; ++i) {
+		root = roots->buff[i];
+		stop = ast_stop(ast, root);
+		if (ast->buff[root].type != AST_BODY) {
+			out_range(ctx, start, stop);
+			start = stop;
+			continue;
+		}
+		start = stop;
+		body = &bodies->buff[ast->buff[root].count];
+		entry = out_stack(ctx);
+		key = cache_key(ctx, body, entry);
+		count = body->sym_end - body->sym_start;
+		stacks = malloc((count ? count : 1) * sizeof(uint64_t));
+		if (cache_get(cache, key, &text, &size, &delta, stacks,
+				count) == 0) {
+			cache->hits++;
+			out_text(ctx, text, size, delta);
+			for (uint32_t j = 0; j < count; ++j)
+				ctx->symbols->buff[body->sym_start + j]->stack =
+					entry + stacks[j];
+		} else {
+			cache->misses++;
+			body_ast = parse_body(ctx, body);
+			out_capture(ctx, body_ast, &text, &size, &delta);
+			ast_pool_destroy(body_ast);
+			for (uint32_t j = 0; j < count; ++j)
+				stacks[j] = ctx->symbols->buff[body->sym_start + j]->stack
+					- entry;
+			cache_put(cache, key, text, size, delta, stacks, count);
+		}
+		free(stacks);
+		free(text);
+	}
+	out_end(ctx);
+	body_vec_destroy(bodies);
+	parse_end(ctx);
+	if (cache->stored)
+		cache_evict(cache);
+	return 0;
+}
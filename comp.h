@@ -5,9 +5,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <setjmp.h>
 
 //#define PAR_DBG
 //#define SCAN_DBG
+//#define SCAN_NO_SIMD
 
 enum token {TK_NON = 0x0, TK_TEXT = 0x1, TK_SEMICOL = 0x3B,
 			TK_INT = 0x4, TK_OP = 0x40, TK_LPAREN = 0x28,
@@ -15,107 +19,380 @@ enum token {TK_NON = 0x0, TK_TEXT = 0x1, TK_SEMICOL = 0x3B,
 			TK_RBRACE = 0x7D, TK_ALL = 0xFFFFFFFF, TK_COMMA = 0x2C};
 
 enum ast_type { AST_OP, AST_INT, AST_ASS, AST_VAR, AST_FUNC,
-			AST_CALL, AST_SKIP};
+			AST_CALL, AST_SKIP, AST_ARGS, AST_BODY};
 
 enum var_type { T_NON = 0, T_INT = 1};
 enum keyword { KW_NON = 0, KW_RET = 1 };
 
-struct token_node {
-	union {
-		struct {
-			void* data;
-			size_t size; 
-		};
-		struct {
-			char* str_val;
-			size_t str_size; 
-		};
-		struct {
-			char char_val; 
-		};
-		struct {
-			int int_val; 
-		};
-	};
-	size_t line;
-	enum token type;
-	struct node *next;
+/*
+ * Reserved words: spelling, first and last character, keyword and
+ * built-in type. KW_SLOT is the perfect hash; the slots become case
+ * labels in kw_classify, so a collision fails to compile.
+ */
+#define KEYWORDS(X) \
+	X("int", 'i', 't', KW_NON, T_INT) \
+	X("return", 'r', 'n', KW_RET, T_NON)
+
+#define KW_SLOT(len, first, last) ((((len) << 2) + (first) + (last)) & 31)
+
+struct src_buf {
+	char* data;
+	size_t size;
+	size_t dropped;
+	int mapped;
+};
+
+int src_load(struct src_buf **src, FILE *fp);
+void src_release(struct src_buf *src);
+void src_drop(struct src_buf *src, size_t upto);
+
+struct arena_blk {
+	struct arena_blk *prev;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	const char* name;
+	struct arena_blk *blk;
+	size_t blk_size;
+	size_t used;
+	size_t reserved;
+	size_t blocks;
 };
 
-void token_str(struct token_node *t, char* str);
+void arena_init(struct arena **arena, const char* name, size_t blk_size);
+void* arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_release(struct arena *a);
+void arena_report(struct arena *a, FILE* fp);
+
+/*
+ * Typed growable arrays. VECTOR_DEFINE(name, type) generates struct name
+ * plus name_init/_reserve/_push/_destroy, and a separate cursor type
+ * (name_begin/_next/_peek) so any number of readers can walk the same
+ * vector at once.
+ */
+#define VECTOR_DEFINE(name, type) \
+struct name { \
+	type *buff; \
+	size_t len; \
+	size_t cap; \
+}; \
+struct name##_cur { \
+	type *next; \
+	type *end; \
+}; \
+static inline void name##_reserve(struct name *v, size_t cap) { \
+	if (cap > v->cap) { \
+		v->buff = realloc(v->buff, cap * sizeof(type)); \
+		v->cap = cap; \
+	} \
+} \
+static inline void name##_init(struct name **vec, size_t cap) { \
+	*vec = calloc(1, sizeof(struct name)); \
+	name##_reserve(*vec, cap); \
+} \
+static inline void name##_destroy(struct name *v) { \
+	free(v->buff); \
+	free(v); \
+} \
+static inline void name##_push(struct name *v, type val) { \
+	if (v->len == v->cap) \
+		name##_reserve(v, v->cap ? v->cap * 2 : 8); \
+	v->buff[v->len++] = val; \
+} \
+static inline struct name##_cur name##_begin(const struct name *v) { \
+	struct name##_cur cur = { v->buff, v->buff + v->len }; \
+	return cur; \
+} \
+static inline type *name##_next(struct name##_cur *cur) { \
+	return cur->next < cur->end ? cur->next++ : NULL; \
+} \
+static inline type *name##_peek(struct name##_cur *cur) { \
+	return cur->next < cur->end ? cur->next : NULL; \
+}
+
+/*
+ * AST nodes live in one pool and refer to each other by index.
+ * Expressions are stored in post-order, so operands precede their
+ * operator and every subtree is a contiguous range ending in its root.
+ * A function node comes first and its body fills (func, end). Call
+ * arguments fill (args, call) behind an AST_ARGS marker whose end is
+ * the call, so code generation can step over them. AST_BODY holds the
+ * place of a function whose body was set aside to be parsed later.
+ */
+#define AST_NIL UINT32_MAX
 
 struct ast_node {
+	uint8_t type;
+	uint8_t vtype;
+	char char_val;
 	union {
-		struct {
-			char* ident;
-			enum var_type vtype;
-		};
-		struct {
-			void* data;
-			size_t size; 
-		};
-		struct {
-			char char_val; 
-		};
-		struct {
-			int int_val; 
-		};
+		uint32_t left; // AST_OP
+		uint32_t sym; // AST_VAR, AST_ASS, AST_CALL, AST_FUNC
+		int32_t int_val; // AST_INT
 	};
-	enum ast_type type;
 	union {
-		struct {
-			struct ast_node *left;
-			struct ast_node *right;
-		};
-		struct {
-			struct vector *many;
-		};
+		uint32_t right; // AST_OP, AST_ASS
+		uint32_t first; // AST_CALL
+		uint32_t end; // AST_FUNC, AST_ARGS
 	};
+	uint32_t count; // AST_FUNC, AST_CALL, AST_BODY
 };
 
+VECTOR_DEFINE(ast_pool, struct ast_node)
+VECTOR_DEFINE(idx_vec, uint32_t)
+VECTOR_DEFINE(sym_vec, struct sym_ent *)
 
-struct vector {
-	void* buff;
-	size_t len;
-	size_t cap;
-	size_t ele_size;
-	void* next;
+/*
+ * A function body the first pass skipped, tokens [start, end). Its
+ * locals are already symbols [sym_start, sym_end); the body is parsed
+ * on its own later, into its own pool.
+ */
+struct func_body {
+	struct sym_ent *se;
+	size_t start;
+	size_t end;
+	uint32_t sym_start;
+	uint32_t sym_end;
+	struct ast_pool *ast;
+	int failed;
+	int wanted;
+};
+
+VECTOR_DEFINE(body_vec, struct func_body)
+
+/*
+ * Top-level declarations handed from the parser to code generation on
+ * another thread, with the symbols they introduced.
+ */
+struct ast_unit {
+	struct ast_pool *ast;
+	struct sym_ent **syms;
+	size_t sym_count;
+};
+
+struct spsc_queue {
+	void** slots;
+	size_t mask;
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
 };
 
-void vector_init(struct vector **vec, size_t ele_size, size_t cap);
-void vector_destroy(struct vector *v);
-void vector_push_back(struct vector *v, void* val);
-void* vector_next(struct vector *v);
-void* vector_peek(struct vector *v);
-void vector_reset(struct vector *v);
-void* vector_back(struct vector *v);
+void q_init(struct spsc_queue **q, size_t cap);
+void q_destroy(struct spsc_queue *q);
+void q_push(struct spsc_queue *q, void* val);
+void* q_pop(struct spsc_queue *q);
+
+typedef void (*pool_fn)(void* arg, size_t i, int worker);
+
+struct pool_thread {
+	pthread_t thread;
+	struct thread_pool *pool;
+	int id;
+};
+
+struct thread_pool {
+	struct pool_thread *threads;
+	int size;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint64_t generation;
+	int busy;
+	int quit;
+	pool_fn fn;
+	void* arg;
+	size_t count;
+	atomic_size_t next;
+};
+
+void pool_init(struct thread_pool **pool, int size);
+void pool_run(struct thread_pool *pool, size_t count, pool_fn fn,
+		void* arg);
+void pool_destroy(struct thread_pool *pool);
 
 struct ht_node {
 	char* key;
 	void* val;
-	struct ht_node *next;
+	uint64_t hash;
 };
 
 struct hashtable {
-	struct ht_node** eles;
+	struct arena *arena;
+	struct ht_node* eles;
 	size_t buckets;
 	size_t count;
 	float bound;
 	size_t it_bucket;
-	struct ht_node* next;
 };
 
-void ht_init(struct hashtable **ht, size_t buckets, float bound);
+void ht_init(struct hashtable **ht, struct arena *arena, size_t buckets,
+		float bound);
 struct ht_node* ht_next(struct hashtable *ht);
 void ht_reset(struct hashtable *ht);
-void ht_destroy(struct hashtable *ht);
 void ht_insert(struct hashtable *ht, char* key, void* val);
 void* ht_find(struct hashtable *ht, char* key);
 
+struct intern_ent {
+	char* str;
+	uint32_t len;
+	uint32_t hash;
+	enum keyword kw;
+	enum var_type vtype;
+};
+
+struct intern_tab {
+	uint32_t *slots;
+	size_t mask;
+	struct intern_ent *ents;
+	size_t count;
+	size_t cap;
+	struct arena *arena;
+};
+
+void intern_init(struct intern_tab **tab, struct arena *arena, size_t cap);
+void intern_destroy(struct intern_tab *tab);
+struct intern_ent *intern(struct intern_tab *tab, const char* str,
+		size_t len);
+void intern_adopt(struct intern_tab *tab, struct intern_ent *ents, size_t n);
+
+/*
+ * Tokens as parallel arrays: a kind byte, a 32-bit payload (int
+ * value, character, or intern id for TK_TEXT) and the source offset.
+ * A TK_NON sentinel always follows the last token. Lines are only
+ * recovered from offsets when an error is reported.
+ *
+ * Token indices are absolute. When streaming, the arrays only hold a
+ * window starting at token base; reading past its end pulls more
+ * from the scanner until it runs out of input.
+ */
+struct scan_ctx;
+
+struct tok_stream {
+	uint8_t *kind;
+	uint32_t *val;
+	uint32_t *off;
+	size_t base;
+	size_t len;
+	size_t cap;
+	struct intern_tab *names;
+	struct src_buf *src;
+	struct scan_ctx *scanner;
+	struct spsc_queue *feed;
+};
+
+/*
+ * A run of tokens scanned on another thread, with copies of the names
+ * first seen in it so the reader can keep its own intern table.
+ */
+struct tok_batch {
+	struct tok_stream *tokens;
+	struct intern_ent *names;
+	size_t name_count;
+};
+
+struct tok_batch *scan_batch(struct scan_ctx *scan_ctx);
+void batch_free(struct tok_batch *batch);
+void ts_append(struct tok_stream *ts, struct tok_batch *batch);
+
+void ts_init(struct tok_stream **ts, struct intern_tab *names,
+		struct src_buf *src, size_t cap);
+void ts_destroy(struct tok_stream *ts);
+void ts_reserve(struct tok_stream *ts, size_t cap);
+size_t ts_line(struct tok_stream *ts, size_t i);
+void token_str(struct tok_stream *ts, size_t i, char* str);
+void ts_fill(struct tok_stream *ts, size_t i);
+void ts_discard(struct tok_stream *ts, size_t upto);
+
+static inline void ts_push(struct tok_stream *ts, enum token kind,
+		uint32_t val, uint32_t off) {
+	if (ts->len + 1 >= ts->cap)
+		ts_reserve(ts, ts->cap * 2);
+	ts->kind[ts->len] = kind;
+	ts->val[ts->len] = val;
+	ts->off[ts->len] = off;
+	ts->len++;
+	ts->kind[ts->len] = TK_NON;
+	ts->off[ts->len] = off;
+}
+
+static inline size_t ts_at(struct tok_stream *ts, size_t i) {
+	if (i - ts->base >= ts->len && (ts->scanner || ts->feed))
+		ts_fill(ts, i);
+	return i - ts->base;
+}
+
+static inline enum token ts_type(struct tok_stream *ts, size_t i) {
+	return ts->kind[ts_at(ts, i)];
+}
+
+static inline char ts_char(struct tok_stream *ts, size_t i) {
+	return ts->val[ts_at(ts, i)];
+}
+
+static inline int ts_int(struct tok_stream *ts, size_t i) {
+	return ts->val[ts_at(ts, i)];
+}
+
+static inline struct intern_ent *ts_name(struct tok_stream *ts, size_t i) {
+	return &ts->names->ents[ts->val[ts_at(ts, i)]];
+}
+
+/*
+ * A compile running as one job among many. Its errors are written to
+ * diag and unwind to bail instead of ending the process.
+ */
+struct compile_job {
+	FILE* diag;
+	jmp_buf bail;
+};
+
+extern _Thread_local struct compile_job *cur_job;
+
+FILE* diag_stream();
+_Noreturn void compile_fail();
+
+struct parse_ctx;
+struct out_ctx;
+
+/*
+ * On-disk cache of emitted functions, one file per key, bounded to
+ * limit bytes by dropping the least recently used files.
+ */
+#define CACHE_LIMIT ((size_t)64 << 20)
+
+struct fn_cache {
+	char* dir;
+	size_t limit;
+	size_t hits;
+	size_t misses;
+	size_t stored;
+	size_t evicted;
+};
+
 struct context {
-	struct vector *tokens;
-	struct vector *asts;
+	FILE* out;
+	struct src_buf *src;
+	struct intern_tab *names;
+	struct tok_stream *tokens;
+	struct ast_pool *ast;
+	struct idx_vec *asts;
 	struct hashtable *syms;
+	struct sym_vec *symbols;
+	struct arena *scan_arena;
+	struct arena *parse_arena;
+	struct arena *out_arena;
+	struct parse_ctx *parser;
+	struct out_ctx *emitter;
+	struct arena **job_arenas;
+	int jobs;
+	struct fn_cache *cache;
+	int ast_mapped;
+	int machine_code;
+	struct jit_image *jit;
 };
 
 struct sym_ent {
@@ -133,10 +410,116 @@ struct sym_ent {
 	int on_stack;
 	enum var_type type;
 	char* name;
+	uint32_t id;
+	size_t decl;
+};
+
+enum char_class { CL_ALPHA = 0x1, CL_DIGIT = 0x2, CL_PUNCT = 0x4 };
+
+extern const uint8_t scan_class[256];
+
+struct scan_kernel {
+	const char* name;
+	size_t (*ident_end)(const char* p, size_t pos, size_t size);
+	size_t (*digit_end)(const char* p, size_t pos, size_t size);
+	size_t (*blank_end)(const char* p, size_t pos, size_t size);
 };
 
+const struct scan_kernel *scan_kernel_select();
+
+int scan_open(struct context *ctx, FILE *fp);
 int scan(struct context *ctx, FILE *fp);
+void parse_begin(struct context *ctx);
+uint32_t parse_next(struct context *ctx);
+void parse_release(struct context *ctx);
+void parse_catch(struct context *ctx, jmp_buf *bail);
+void parse_fail(struct context *ctx);
+struct ast_unit *parse_take(struct context *ctx);
+void parse_end(struct context *ctx);
 int parse(struct context *ctx);
+int parse_parallel(struct context *ctx, struct thread_pool *pool);
+int parse_lazy(struct context *ctx, char** entries, int entry_count);
+struct body_vec *parse_signatures(struct context *ctx);
+struct ast_pool *parse_body(struct context *ctx, struct func_body *body);
+uint32_t ast_stop(struct ast_pool *pool, uint32_t node);
+void out_begin(struct context *ctx);
+void out_range(struct context *ctx, uint32_t start, uint32_t end);
+void out_unit(struct context *ctx, struct ast_unit *unit);
+void out_abort(struct context *ctx);
+void out_flush(struct context *ctx);
+void out_end(struct context *ctx);
 int out(struct context *ctx);
+int out_parallel(struct context *ctx, struct thread_pool *pool);
+uint64_t out_stack(struct context *ctx);
+void out_text(struct context *ctx, const char* text, size_t size,
+		uint64_t delta);
+void out_capture(struct context *ctx, struct ast_pool *ast, char** text,
+		size_t *size, uint64_t *delta);
+int incremental(struct context *ctx, FILE *fp, char* dir, size_t limit);
+int ast_save(struct context *ctx, const char* path);
+int ast_load(struct context *ctx, FILE *fp);
+int pipeline(struct context *ctx, FILE *fp);
+
+struct options {
+	int stats;
+	int streaming;
+	int piped;
+	int jobs;
+	int lazily;
+	int batch;
+	int assemble;
+	int link;
+	int integrated;
+	int run;
+	int interp;
+	char* output;
+	char* emit_ast;
+	int from_ast;
+	char* cache_dir;
+	size_t cache_limit;
+	char* path;
+	char** entries;
+	int entry_count;
+	char** files;
+	int file_count;
+};
+
+int parse_options(struct options *opt, int argc, char **argv);
+void options_release(struct options *opt);
+int compile(struct context *ctx, FILE *fp, struct options *opt);
+int front_end(struct context *ctx, FILE *fp, struct options *opt);
+double wall_time();
+void report_stats(struct context *ctx, double elapsed);
+void context_reset(struct context *ctx);
+void context_release(struct context *ctx);
+struct elf_obj;
+void elf_init(struct elf_obj **obj, struct arena *arena, const char* file);
+void elf_func_begin(struct elf_obj *obj, char* name, uint64_t pos);
+void elf_func_end(struct elf_obj *obj, char* name, uint64_t pos);
+void elf_call(struct elf_obj *obj, char* name, uint64_t offset);
+int write_elf(struct elf_obj *obj, int fd, const char* code, size_t size);
+void elf_destroy(struct elf_obj *obj);
+int64_t elf_lookup(struct elf_obj *obj, const char* name);
+const char* elf_relocate(struct elf_obj *obj, char* code);
+int read_full(int fd, void* buf, size_t size);
+int write_full(int fd, const void* buf, size_t size);
+int build(struct context *ctx, FILE *fp, struct options *opt);
+char* object_name(char* path);
+
+typedef int64_t (*jit_func)(void);
+
+struct jit_image {
+	const char* entry;
+	char* code;
+	size_t size;
+	jit_func func;
+};
+
+void jit_load(struct jit_image *image, struct elf_obj *obj, const char* code,
+		size_t size);
+int jit_run(struct context *ctx, FILE *fp, struct options *opt);
+int interp(struct context *ctx, FILE *fp, struct options *opt);
+int serve(char* sock_path);
+int connect_server(char* sock_path, int argc, char **argv);
 
 #endif
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "comp.h"
+
+extern char **environ;
+
+/*
+ * Builds objects and executables without a .s file in between. The
+ * assembler reads from a pipe that is the emitter's output, so it
+ * works while code is still being generated. Linking goes through
+ * the C compiler driver, which knows where the C runtime lives; $AS
+ * and $CC pick other tools. With --integrated-as the emitter encodes
+ * the instructions itself and the object is written directly.
+ */
+
+struct as_proc {
+	pid_t pid;
+	FILE* in;
+};
+
+int spawn(pid_t *pid, char** argv, int in_fd) {
+	posix_spawn_file_actions_t fa;
+	int err;
+	posix_spawn_file_actions_init(&fa);
+	if (in_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&fa, in_fd, 0);
+		posix_spawn_file_actions_addclose(&fa, in_fd);
+	}
+	err = posix_spawnp(pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err) {
+		fprintf(stderr, "cannot run %s\n", argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+int spawn_wait(pid_t pid) {
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int as_start(struct as_proc *as, char* obj) {
+	char* tool = getenv("AS") ? getenv("AS") : "as";
+	char* argv[] = { tool, "--noexecstack", "-o", obj, NULL };
+	int fds[2];
+	if (pipe(fds) == -1)
+		return -1;
+	// the write end must not leak into the assembler, or it never sees EOF
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	if (spawn(&as->pid, argv, fds[0]) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	close(fds[0]);
+	as->in = fdopen(fds[1], "w");
+	return 0;
+}
+
+/*
+ * An assembler fed by a failed compile is stopped before it sees EOF,
+ * so it cannot turn half a program into an object.
+ */
+int as_finish(struct as_proc *as, int failed) {
+	if (failed)
+		kill(as->pid, SIGTERM);
+	fclose(as->in);
+	return spawn_wait(as->pid) == -1 || failed ? -1 : 0;
+}
+
+int link_exe(char* obj, char* exe) {
+	char* tool = getenv("CC") ? getenv("CC") : "cc";
+	char* argv[] = { tool, obj, "-o", exe, NULL };
+	pid_t pid;
+	if (spawn(&pid, argv, -1) == -1)
+		return -1;
+	return spawn_wait(pid);
+}
+
+/*
+ * foo.c becomes foo.o in the current directory, as with cc -c.
+ */
+char* object_name(char* path) {
+	char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	size_t len = strlen(base);
+	char* obj = malloc(len + 3);
+	if (len > 2 && !strcmp(base + len - 2, ".c"))
+		len -= 2;
+	memcpy(obj, base, len);
+	strcpy(obj + len, ".o");
+	return obj;
+}
+
+/*
+ * Labels and call sites are recorded as the code is encoded, which the
+ * threaded emitter and replayed cache entries would skip, so the
+ * integrated assembler always compiles in order.
+ */
+int build_direct(struct context *ctx, FILE *fp, struct options *opt,
+		char* obj) {
+	struct compile_job job = { diag_stream() };
+	int failed = 0;
+	if ((ctx->out = fopen(obj, "wb")) == NULL) {
+		fprintf(stderr, "cannot write %s\n", obj);
+		return -1;
+	}
+	ctx->machine_code = 1;
+	opt->jobs = 0;
+	opt->cache_dir = NULL;
+	cur_job = &job;
+	if (setjmp(job.bail) || compile(ctx, fp, opt) == -1)
+		failed = 1;
+	cur_job = NULL;
+	if (ctx->parser)
+		parse_end(ctx);
+	if (ctx->emitter)
+		out_abort(ctx);
+	if (fclose(ctx->out) != 0)
+		failed = 1;
+	ctx->out = NULL;
+	return failed ? -1 : 0;
+}
+
+int build(struct context *ctx, FILE *fp, struct options *opt) {
+	struct compile_job job = { diag_stream() };
+	struct as_proc as;
+	char tmp[] = "/tmp/compilerXXXXXX.o";
+	char* obj;
+	int failed = 0, fd;
+	if (opt->link) {
+		if ((fd = mkstemps(tmp, 2)) == -1)
+			return 1;
+		close(fd);
+		obj = strdup(tmp);
+	} else {
+		obj = opt->output ? strdup(opt->output) : object_name(opt->path);
+	}
+	if (opt->integrated) {
+		failed = build_direct(ctx, fp, opt, obj) == -1;
+		goto link;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (as_start(&as, obj) == -1) {
+		free(obj);
+		return 1;
+	}
+	ctx->out = as.in;
+	cur_job = &job;
+	if (setjmp(job.bail) || compile(ctx, fp, opt) == -1)
+		failed = 1;
+	cur_job = NULL;
+	if (ctx->parser)
+		parse_end(ctx);
+	if (ctx->emitter)
+		out_abort(ctx);
+	if (as_finish(&as, failed) == -1)
+		failed = 1;
+link:
+	if (!failed && opt->link
+			&& link_exe(obj, opt->output ? opt->output : "a.out") == -1)
+		failed = 1;
+	if (failed || opt->link)
+		unlink(obj);
+	free(obj);
+	return failed;
+}
@@ -0,0 +1,241 @@
+#include <elf.h>
+#include "comp.h"
+
+/*
+ * Relocatable ELF64 objects for the machine code the emitter encodes
+ * itself. The code is a single .text section; functions become global
+ * symbols as with .globl, their PRE/POST labels locals, and every call
+ * an R_X86_64_PLT32 relocation against the callee, which stays
+ * undefined if this file has no body for it. Sections in the file:
+ *
+ *   0 null | 1 .text | 2 .rela.text | 3 .note.GNU-stack | 4 .symtab
+ *   5 .strtab | 6 .shstrtab
+ */
+
+enum elf_section {SEC_TEXT = 1, SEC_RELA, SEC_STACK, SEC_SYMTAB, SEC_STRTAB,
+				SEC_SHSTRTAB, SEC_COUNT};
+
+static const char elf_shstr[] = "\0.text\0.rela.text\0.note.GNU-stack\0"
+	".symtab\0.strtab\0.shstrtab";
+
+struct elf_global {
+	uint32_t name;
+	uint64_t value;
+	uint64_t size;
+	int defined;
+	uint32_t index;
+};
+
+struct elf_reloc {
+	uint64_t offset;
+	struct elf_global *sym;
+};
+
+VECTOR_DEFINE(elf_sym_vec, Elf64_Sym)
+VECTOR_DEFINE(elf_global_vec, struct elf_global *)
+VECTOR_DEFINE(elf_reloc_vec, struct elf_reloc)
+VECTOR_DEFINE(elf_str_vec, char)
+
+struct elf_obj {
+	struct arena *arena;
+	struct hashtable *names;
+	struct elf_sym_vec locals;
+	struct elf_global_vec globals;
+	struct elf_reloc_vec relocs;
+	struct elf_str_vec strtab;
+};
+
+uint32_t elf_str(struct elf_obj *obj, const char* s, const char* suffix) {
+	uint32_t off = obj->strtab.len;
+	size_t len = strlen(s), slen = strlen(suffix);
+	elf_str_vec_reserve(&obj->strtab, obj->strtab.len + len + slen + 1);
+	memcpy(obj->strtab.buff + obj->strtab.len, s, len);
+	memcpy(obj->strtab.buff + obj->strtab.len + len, suffix, slen + 1);
+	obj->strtab.len += len + slen + 1;
+	return off;
+}
+
+void elf_init(struct elf_obj **obj, struct arena *arena, const char* file) {
+	struct elf_obj *o = arena_alloc(arena, sizeof(struct elf_obj));
+	Elf64_Sym sym = { 0 };
+	o->arena = arena;
+	ht_init(&o->names, arena, 64, 0.75f);
+	elf_str_vec_push(&o->strtab, '\0');
+	elf_sym_vec_push(&o->locals, sym);
+	sym.st_name = elf_str(o, file, "");
+	sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+	sym.st_shndx = SHN_ABS;
+	elf_sym_vec_push(&o->locals, sym);
+	*obj = o;
+}
+
+void elf_destroy(struct elf_obj *obj) {
+	free(obj->locals.buff);
+	free(obj->globals.buff);
+	free(obj->relocs.buff);
+	free(obj->strtab.buff);
+}
+
+struct elf_global *elf_global(struct elf_obj *obj, char* name) {
+	struct elf_global *g = ht_find(obj->names, name);
+	if (g != NULL)
+		return g;
+	g = arena_alloc(obj->arena, sizeof(struct elf_global));
+	g->name = elf_str(obj, name, "");
+	ht_insert(obj->names, name, g);
+	elf_global_vec_push(&obj->globals, g);
+	return g;
+}
+
+void elf_label(struct elf_obj *obj, char* name, const char* suffix,
+		uint64_t value) {
+	Elf64_Sym sym = { .st_name = elf_str(obj, name, suffix),
+		.st_info = ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE),
+		.st_shndx = SEC_TEXT, .st_value = value };
+	elf_sym_vec_push(&obj->locals, sym);
+}
+
+void elf_func_begin(struct elf_obj *obj, char* name, uint64_t pos) {
+	struct elf_global *g = elf_global(obj, name);
+	elf_label(obj, name, "PRE", pos);
+	g->value = pos;
+	g->defined = 1;
+}
+
+void elf_func_end(struct elf_obj *obj, char* name, uint64_t pos) {
+	struct elf_global *g = elf_global(obj, name);
+	elf_label(obj, name, "POST", pos);
+	g->size = pos - g->value;
+}
+
+/*
+ * Records the 32-bit displacement at offset as a call to name.
+ */
+void elf_call(struct elf_obj *obj, char* name, uint64_t offset) {
+	struct elf_reloc rel = { offset, elf_global(obj, name) };
+	elf_reloc_vec_push(&obj->relocs, rel);
+}
+
+static inline size_t elf_align(size_t off) {
+	return (off + 7) & ~(size_t)7;
+}
+
+/*
+ * Lays the file out behind the header: code, relocations, symbols and
+ * strings, then the section headers. Everything is assembled in one
+ * buffer and written at once.
+ */
+int write_elf(struct elf_obj *obj, int fd, const char* code, size_t size) {
+	Elf64_Shdr sh[SEC_COUNT] = { 0 };
+	Elf64_Ehdr *eh;
+	Elf64_Sym *sym;
+	Elf64_Rela *rela;
+	size_t nsyms = obj->locals.len + obj->globals.len, off, total;
+	struct elf_global *g;
+	char* file;
+	int res;
+	off = sizeof(Elf64_Ehdr);
+	sh[SEC_TEXT] = (Elf64_Shdr){ .sh_name = 1, .sh_type = SHT_PROGBITS,
+		.sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_offset = off,
+		.sh_size = size, .sh_addralign = 1 };
+	off = elf_align(off + size);
+	sh[SEC_RELA] = (Elf64_Shdr){ .sh_name = 7, .sh_type = SHT_RELA,
+		.sh_flags = SHF_INFO_LINK, .sh_offset = off,
+		.sh_size = obj->relocs.len * sizeof(Elf64_Rela),
+		.sh_link = SEC_SYMTAB, .sh_info = SEC_TEXT, .sh_addralign = 8,
+		.sh_entsize = sizeof(Elf64_Rela) };
+	off += sh[SEC_RELA].sh_size;
+	sh[SEC_STACK] = (Elf64_Shdr){ .sh_name = 18, .sh_type = SHT_PROGBITS,
+		.sh_offset = off, .sh_addralign = 1 };
+	sh[SEC_SYMTAB] = (Elf64_Shdr){ .sh_name = 34, .sh_type = SHT_SYMTAB,
+		.sh_offset = off, .sh_size = nsyms * sizeof(Elf64_Sym),
+		.sh_link = SEC_STRTAB, .sh_info = obj->locals.len,
+		.sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym) };
+	off += sh[SEC_SYMTAB].sh_size;
+	sh[SEC_STRTAB] = (Elf64_Shdr){ .sh_name = 42, .sh_type = SHT_STRTAB,
+		.sh_offset = off, .sh_size = obj->strtab.len, .sh_addralign = 1 };
+	off += obj->strtab.len;
+	sh[SEC_SHSTRTAB] = (Elf64_Shdr){ .sh_name = 50, .sh_type = SHT_STRTAB,
+		.sh_offset = off, .sh_size = sizeof(elf_shstr), .sh_addralign = 1 };
+	off = elf_align(off + sizeof(elf_shstr));
+	total = off + sizeof(sh);
+
+	file = calloc(1, total);
+	eh = (Elf64_Ehdr *)file;
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS64;
+	eh->e_ident[EI_DATA] = ELFDATA2LSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_ident[EI_OSABI] = ELFOSABI_NONE;
+	eh->e_type = ET_REL;
+	eh->e_machine = EM_X86_64;
+	eh->e_version = EV_CURRENT;
+	eh->e_shoff = off;
+	eh->e_ehsize = sizeof(Elf64_Ehdr);
+	eh->e_shentsize = sizeof(Elf64_Shdr);
+	eh->e_shnum = SEC_COUNT;
+	eh->e_shstrndx = SEC_SHSTRTAB;
+	memcpy(file + sh[SEC_TEXT].sh_offset, code, size);
+
+	sym = (Elf64_Sym *)(file + sh[SEC_SYMTAB].sh_offset);
+	memcpy(sym, obj->locals.buff, obj->locals.len * sizeof(Elf64_Sym));
+	sym += obj->locals.len;
+	for (size_t i = 0; i < obj->globals.len; ++i) {
+		g = obj->globals.buff[i];
+		g->index = obj->locals.len + i;
+		sym[i].st_name = g->name;
+		if (g->defined) {
+			sym[i].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+			sym[i].st_shndx = SEC_TEXT;
+			sym[i].st_value = g->value;
+			sym[i].st_size = g->size;
+		} else {
+			sym[i].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+			sym[i].st_shndx = SHN_UNDEF;
+		}
+	}
+	rela = (Elf64_Rela *)(file + sh[SEC_RELA].sh_offset);
+	for (size_t i = 0; i < obj->relocs.len; ++i) {
+		rela[i].r_offset = obj->relocs.buff[i].offset;
+		rela[i].r_info = ELF64_R_INFO(obj->relocs.buff[i].sym->index,
+				R_X86_64_PLT32);
+		rela[i].r_addend = -4;
+	}
+	memcpy(file + sh[SEC_STRTAB].sh_offset, obj->strtab.buff, obj->strtab.len);
+	memcpy(file + sh[SEC_SHSTRTAB].sh_offset, elf_shstr, sizeof(elf_shstr));
+	memcpy(file + off, sh, sizeof(sh));
+	res = write_full(fd, file, total);
+	free(file);
+	return res;
+}
+
+/*
+ * Offset of the function name defined in this object, or -1.
+ */
+int64_t elf_lookup(struct elf_obj *obj, const char* name) {
+	struct elf_global *g;
+	for (size_t i = 0; i < obj->globals.len; ++i) {
+		g = obj->globals.buff[i];
+		if (g->defined && !strcmp(obj->strtab.buff + g->name, name))
+			return g->value;
+	}
+	return -1;
+}
+
+/*
+ * Does what the linker would for the calls in code, which must all be
+ * to functions in this object. Returns the first callee without a
+ * body, or NULL once every call is patched.
+ */
+const char* elf_relocate(struct elf_obj *obj, char* code) {
+	struct elf_reloc *rel;
+	int32_t disp;
+	for (size_t i = 0; i < obj->relocs.len; ++i) {
+		rel = &obj->relocs.buff[i];
+		if (!rel->sym->defined)
+			return obj->strtab.buff + rel->sym->name;
+		disp = rel->sym->value - (rel->offset + 4);
+		memcpy(code + rel->offset, &disp, sizeof(disp));
+	}
+	return NULL;
+}
@@ -1,98 +1,105 @@
 #include "comp.h"
 
-void ht_init(struct hashtable **ht, size_t buckets, float bound) {
-	struct hashtable *h = calloc(1, sizeof(struct hashtable));
-	h->eles = calloc(buckets, sizeof(struct ht_node *));
-	h->buckets = buckets;
+/*
+ * Open addressing with Robin Hood probing. Entries live directly in
+ * the slot array next to their full 64-bit hash; a NULL key marks an
+ * empty slot. Growing moves entries into a doubled array, nothing is
+ * allocated per entry. The arrays come from the table's arena, like
+ * the table itself, and go when it is reset.
+ */
+
+void ht_init(struct hashtable **ht, struct arena *arena, size_t buckets,
+		float bound) {
+	struct hashtable *h = arena_alloc(arena, sizeof(struct hashtable));
+	size_t cap = 8;
+	while (cap < buckets)
+		cap *= 2;
+	h->arena = arena;
+	h->eles = arena_alloc(arena, cap * sizeof(struct ht_node));
+	h->buckets = cap;
 	h->bound = bound;
 	h->count = 0;
-	h->next = NULL;
 	h->it_bucket = 0;
 	*ht = h;
 }
 
 struct ht_node *ht_next(struct hashtable *ht) {
-	struct ht_node* res;
 	while (ht->it_bucket < ht->buckets) {
-		res = ht->next;
-		if (res != NULL) {
-			ht->next = res->next;
+		struct ht_node *res = &ht->eles[ht->it_bucket++];
+		if (res->key != NULL)
 			return res;
-		} else {
-			ht->next = ht->eles[++ht->it_bucket];
-		}
 	}
 	return NULL;
 }
 
 void ht_reset(struct hashtable *ht) {
-	ht->next = ht->eles[0];
 	ht->it_bucket = 0;
 }
 
-void ht_destroy(struct hashtable *ht) {
-	struct ht_node* node;
-	struct ht_node* prev = NULL;
-	while ((node = ht_next(ht)) != NULL) {
-		if (prev != NULL) {
-			free(prev);
+/*
+ * Keys are interned names, so the address is the identity and
+ * neither hashing nor lookup needs to touch the characters.
+ */
+uint64_t ht_hash(char* val) {
+	uint64_t hash = (uintptr_t)val;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+void ht_place(struct hashtable *ht, struct ht_node ent) {
+	size_t mask = ht->buckets - 1;
+	size_t i = ent.hash & mask;
+	size_t dist = 0, other;
+	struct ht_node tmp;
+	while (ht->eles[i].key != NULL) {
+		// steal the slot from any entry closer to its home
+		other = (i - ht->eles[i].hash) & mask;
+		if (other < dist) {
+			tmp = ht->eles[i];
+			ht->eles[i] = ent;
+			ent = tmp;
+			dist = other;
 		}
-		prev = node;
-	}
-	if (prev != NULL) {
-		free(prev);
+		i = (i + 1) & mask;
+		dist++;
 	}
-	free(ht->eles);
-	free(ht);
+	ht->eles[i] = ent;
 }
 
-uint8_t ht_hash(struct hashtable *ht, char* val) {
-	// djb2 hash
-	uint32_t hash = 5381;
-	uint8_t c;
-	while (c = *val++) {
-		hash = ((hash << 5) + hash) + c;
+void ht_grow(struct hashtable *ht) {
+	struct ht_node *old_eles = ht->eles;
+	size_t old_buckets = ht->buckets;
+	ht->buckets *= 2;
+	ht->eles = arena_alloc(ht->arena, ht->buckets * sizeof(struct ht_node));
+	for (size_t i = 0; i < old_buckets; ++i) {
+		if (old_eles[i].key != NULL)
+			ht_place(ht, old_eles[i]);
 	}
-	return hash % ht->buckets;
 }
 
 void ht_insert(struct hashtable *ht, char* key, void* val) {
-	// rehash if n/k > load factor threshold
-	if (((float)ht->count + 1) / ht->buckets > ht->bound) {
-		struct ht_node** old_eles  = ht->eles;
-		struct ht_node* node;
-		struct hashtable *new_ht;
-		
-		ht_reset(ht);
-		ht_init(&new_ht, ht->buckets * 2, ht->bound);
-		new_ht->count = ht->count;
-		while ((node = ht_next(ht)) != NULL) {
-			ht_insert(new_ht, node->key, node->val);
-			free(node);
-		}
-		memcpy(ht, new_ht, sizeof(struct hashtable));
-		free(new_ht);
-		free(old_eles);
-	}
-
-	uint8_t hash = ht_hash(ht, key);
-
-	struct ht_node* new_node = calloc(1, sizeof(struct ht_node));
-	new_node->val = val;
-	new_node->key = key;
-	new_node->next = ht->eles[hash];
-	ht->eles[hash] = new_node;
+	if (((float)ht->count + 1) / ht->buckets > ht->bound)
+		ht_grow(ht);
+	struct ht_node ent = { key, val, ht_hash(key) };
+	ht_place(ht, ent);
 	ht->count += 1;
 }
 
 void *ht_find(struct hashtable *ht, char* key) {
-	struct ht_node *node = ht->eles[ht_hash(ht, key)];
-	int it = 0;
-	while (node != NULL) {
-		if (!strcmp(node->key, key)) {
-			return node->val;
-		}
-		node = node->next;
+	size_t mask = ht->buckets - 1;
+	uint64_t hash = ht_hash(key);
+	size_t i = hash & mask;
+	for (size_t dist = 0; ht->eles[i].key != NULL; ++dist) {
+		if (ht->eles[i].hash == hash && ht->eles[i].key == key)
+			return ht->eles[i].val;
+		// Robin Hood invariant: past this point the key can't be stored
+		if (((i - ht->eles[i].hash) & mask) < dist)
+			return NULL;
+		i = (i + 1) & mask;
 	}
 	return NULL;
 }
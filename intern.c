@@ -0,0 +1,115 @@
+#include "comp.h"
+
+/*
+ * Every distinct identifier is stored once in the scan arena. Lookups
+ * probe an open addressed slot array holding (id + 1), with the full
+ * hash kept per entry so most mismatches never reach memcmp.
+ */
+
+void intern_init(struct intern_tab **tab, struct arena *arena, size_t cap) {
+	struct intern_tab *t = arena_alloc(arena, sizeof(struct intern_tab));
+	size_t slots = 16;
+	while (slots < cap * 2)
+		slots *= 2;
+	t->slots = calloc(slots, sizeof(uint32_t));
+	t->mask = slots - 1;
+	t->ents = malloc(cap * sizeof(struct intern_ent));
+	t->cap = cap;
+	t->count = 0;
+	t->arena = arena;
+	*tab = t;
+}
+
+/*
+ * Appends entries interned elsewhere, keeping their ids. Only the
+ * entry array is filled, the table is read by id and never probed.
+ */
+void intern_adopt(struct intern_tab *tab, struct intern_ent *ents, size_t n) {
+	if (tab->count + n > tab->cap) {
+		while (tab->count + n > tab->cap)
+			tab->cap *= 2;
+		tab->ents = realloc(tab->ents, tab->cap * sizeof(struct intern_ent));
+	}
+	memcpy(tab->ents + tab->count, ents, n * sizeof(struct intern_ent));
+	tab->count += n;
+}
+
+void intern_destroy(struct intern_tab *tab) {
+	free(tab->slots);
+	free(tab->ents);
+}
+
+uint32_t intern_hash(const char* str, size_t len) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (uint8_t)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+char* intern_copy(struct intern_tab *tab, const char* str, size_t len) {
+	char* res = arena_alloc(tab->arena, len + 1);
+	memcpy(res, str, len);
+	return res;
+}
+
+void intern_grow(struct intern_tab *tab) {
+	size_t slots = (tab->mask + 1) * 2;
+	free(tab->slots);
+	tab->slots = calloc(slots, sizeof(uint32_t));
+	tab->mask = slots - 1;
+	for (uint32_t id = 0; id < tab->count; ++id) {
+		size_t i = tab->ents[id].hash & tab->mask;
+		while (tab->slots[i])
+			i = (i + 1) & tab->mask;
+		tab->slots[i] = id + 1;
+	}
+}
+
+void kw_classify(struct intern_ent *ent) {
+	const char* str = ent->str;
+	size_t len = ent->len;
+	ent->kw = KW_NON;
+	ent->vtype = T_NON;
+	switch (KW_SLOT(len, str[0], str[len - 1])) {
+#define X(word, first, last, kw_val, vtype_val) \
+		case KW_SLOT(sizeof(word) - 1, first, last): \
+			if (len == sizeof(word) - 1 && !memcmp(str, word, len)) { \
+				ent->kw = kw_val; \
+				ent->vtype = vtype_val; \
+			} \
+			break;
+		KEYWORDS(X)
+#undef X
+	}
+}
+
+struct intern_ent *intern(struct intern_tab *tab, const char* str,
+		size_t len) {
+	uint32_t hash = intern_hash(str, len);
+	size_t i = hash & tab->mask;
+	uint32_t slot;
+	struct intern_ent *ent;
+	while ((slot = tab->slots[i]) != 0) {
+		ent = &tab->ents[slot - 1];
+		if (ent->hash == hash && ent->len == len
+				&& !memcmp(ent->str, str, len))
+			return ent;
+		i = (i + 1) & tab->mask;
+	}
+	if (tab->count == tab->cap) {
+		tab->cap *= 2;
+		tab->ents = realloc(tab->ents, tab->cap * sizeof(struct intern_ent));
+	}
+	ent = &tab->ents[tab->count];
+	ent->str = intern_copy(tab, str, len);
+	ent->len = len;
+	ent->hash = hash;
+	kw_classify(ent);
+	tab->slots[i] = ++tab->count;
+	if (tab->count * 2 > tab->mask)
+		intern_grow(tab);
+	return ent;
+}
@@ -0,0 +1,42 @@
+#include <errno.h>
+#include <unistd.h>
+#include "comp.h"
+
+/*
+ * Whole-buffer reads and writes on a descriptor. Both return -1 on an
+ * error or end of file short of size, with errno set.
+ */
+
+int read_full(int fd, void* buf, size_t size) {
+	size_t got = 0;
+	ssize_t n;
+	while (got < size) {
+		n = read(fd, (char*)buf + got, size - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+int write_full(int fd, const void* buf, size_t size) {
+	size_t put = 0;
+	ssize_t n;
+	while (put < size) {
+		n = write(fd, (const char*)buf + put, size - put);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		put += n;
+	}
+	return 0;
+}
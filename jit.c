@@ -0,0 +1,102 @@
+#include <signal.h>
+#include <sys/mman.h>
+#include "comp.h"
+
+/*
+ * In-process execution. The code the integrated assembler encodes is
+ * copied into an mmap'd region, calls are patched to point at their
+ * callees there, and the region is made executable (never writable and
+ * executable at once) before the entry function is called directly.
+ */
+
+void jit_err(const char* what, const char* name) {
+	fprintf(diag_stream(), "%s %s\n", what, name);
+	compile_fail();
+}
+
+/*
+ * Called by out_end in place of writing an object file.
+ */
+void jit_load(struct jit_image *image, struct elf_obj *obj, const char* code,
+		size_t size) {
+	const char* missing;
+	int64_t entry = elf_lookup(obj, image->entry);
+	if (entry < 0)
+		jit_err("No entry function", image->entry);
+	image->size = size;
+	image->code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image->code == MAP_FAILED) {
+		image->code = NULL;
+		jit_err("Cannot map code for", image->entry);
+	}
+	memcpy(image->code, code, size);
+	if ((missing = elf_relocate(obj, image->code)) != NULL)
+		jit_err("Undefined function", missing);
+	if (mprotect(image->code, size, PROT_READ | PROT_EXEC) == -1)
+		jit_err("Cannot map code for", image->entry);
+	image->func = (jit_func)(image->code + entry);
+}
+
+static sigjmp_buf jit_trap;
+
+void jit_on_trap(int sig) {
+	siglongjmp(jit_trap, sig);
+}
+
+/*
+ * idivq raises SIGFPE for a zero divisor or INT64_MIN / -1. The trap
+ * is taken back here and returns -1, so the compiler survives it.
+ */
+int jit_call(struct jit_image *image, int64_t *result) {
+	struct sigaction sa = { .sa_handler = jit_on_trap }, old;
+	int res = 0;
+	sigaction(SIGFPE, &sa, &old);
+	if (sigsetjmp(jit_trap, 1) == 0)
+		*result = image->func();
+	else
+		res = -1;
+	sigaction(SIGFPE, &old, NULL);
+	return res;
+}
+
+void jit_unload(struct jit_image *image) {
+	if (image->code)
+		munmap(image->code, image->size);
+	image->code = NULL;
+	image->func = NULL;
+}
+
+/*
+ * Compiles in order, as with --integrated-as, then runs the first
+ * --entry function and prints what it returns like an int, to the
+ * same stream as errors.
+ */
+int jit_run(struct context *ctx, FILE *fp, struct options *opt) {
+	struct jit_image image = { opt->entries[0] };
+	struct compile_job job = { diag_stream() };
+	int64_t result;
+	int failed = 0;
+	ctx->out = stdout;
+	ctx->machine_code = 1;
+	ctx->jit = &image;
+	opt->jobs = 0;
+	opt->cache_dir = NULL;
+	cur_job = &job;
+	if (setjmp(job.bail) || compile(ctx, fp, opt) == -1)
+		failed = 1;
+	cur_job = NULL;
+	if (ctx->parser)
+		parse_end(ctx);
+	if (ctx->emitter)
+		out_abort(ctx);
+	ctx->jit = NULL;
+	// reported as --interp reports the same division
+	if (!failed && image.func && jit_call(&image, &result) == -1) {
+		fprintf(job.diag, "Arithmetic error in division\n");
+		failed = 1;
+	} else if (!failed && image.func)
+		fprintf(job.diag, "%d\n", (int)result);
+	jit_unload(&image);
+	return failed;
+}
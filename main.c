@@ -1,15 +1,454 @@
+#include <time.h>
 #include "comp.h"
 
-int main(int argc, char **argv) {
-	FILE* fp = fopen(argv[1], "r");
-	if (fp == NULL)
+/*
+ * Frees what one compile built but keeps the arenas, emptied, for the
+ * next compile in the same context.
+ */
+void context_reset(struct context *ctx) {
+	if (ctx->tokens)
+		ts_destroy(ctx->tokens);
+	// a mapped pool's nodes belong to the file in ctx->src
+	if (ctx->ast && ctx->ast_mapped)
+		free(ctx->ast);
+	else if (ctx->ast)
+		ast_pool_destroy(ctx->ast);
+	if (ctx->asts)
+		idx_vec_destroy(ctx->asts);
+	if (ctx->symbols)
+		sym_vec_destroy(ctx->symbols);
+	if (ctx->names)
+		intern_destroy(ctx->names);
+	if (ctx->src)
+		src_release(ctx->src);
+	free(ctx->cache);
+	if (ctx->scan_arena)
+		arena_reset(ctx->scan_arena);
+	if (ctx->parse_arena)
+		arena_reset(ctx->parse_arena);
+	if (ctx->out_arena)
+		arena_reset(ctx->out_arena);
+	for (int i = 0; i < ctx->jobs; ++i)
+		arena_reset(ctx->job_arenas[i]);
+	ctx->tokens = NULL;
+	ctx->ast = NULL;
+	ctx->ast_mapped = 0;
+	ctx->asts = NULL;
+	ctx->syms = NULL;
+	ctx->symbols = NULL;
+	ctx->names = NULL;
+	ctx->src = NULL;
+	ctx->parser = NULL;
+	ctx->emitter = NULL;
+	ctx->cache = NULL;
+	ctx->machine_code = 0;
+}
+
+void context_release(struct context *ctx) {
+	context_reset(ctx);
+	if (ctx->scan_arena)
+		arena_release(ctx->scan_arena);
+	if (ctx->parse_arena)
+		arena_release(ctx->parse_arena);
+	if (ctx->out_arena)
+		arena_release(ctx->out_arena);
+	for (int i = 0; i < ctx->jobs; ++i)
+		arena_release(ctx->job_arenas[i]);
+	free(ctx->job_arenas);
+	free(ctx);
+}
+
+double wall_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report_stats(struct context *ctx, double elapsed) {
+	fprintf(stderr, "time   %12.3f s\n", elapsed);
+	if (ctx->scan_arena)
+		arena_report(ctx->scan_arena, stderr);
+	if (ctx->parse_arena)
+		arena_report(ctx->parse_arena, stderr);
+	if (ctx->ast)
+		fprintf(stderr, "ast          %12zu bytes used %12zu nodes\n",
+				ctx->ast->len * sizeof(struct ast_node), ctx->ast->len);
+	if (ctx->out_arena)
+		arena_report(ctx->out_arena, stderr);
+	for (int i = 0; i < ctx->jobs; ++i)
+		arena_report(ctx->job_arenas[i], stderr);
+	if (ctx->cache)
+		fprintf(stderr, "cache  %8zu hits %8zu misses %8zu stored "
+				"%8zu evicted\n", ctx->cache->hits, ctx->cache->misses,
+				ctx->cache->stored, ctx->cache->evicted);
+}
+
+/*
+ * Emits each top-level declaration as soon as it is parsed and then
+ * drops its tokens and nodes, so memory follows the largest
+ * declaration rather than the whole file. The code for everything
+ * before a parse error is written out ahead of the error.
+ */
+int stream(struct context *ctx, FILE *fp) {
+	jmp_buf bail;
+	if (scan_open(ctx, fp) == -1)
+		return -1;
+	parse_begin(ctx);
+	out_begin(ctx);
+	parse_catch(ctx, &bail);
+	if (setjmp(bail)) {
+		out_flush(ctx);
+		parse_fail(ctx);
+	}
+	while (parse_next(ctx) != AST_NIL) {
+		out_range(ctx, 0, ctx->ast->len);
+		parse_release(ctx);
+	}
+	parse_end(ctx);
+	out_end(ctx);
+	return 0;
+}
+
+// one arena per worker thread
+void job_arenas(struct context *ctx, int jobs) {
+	if (ctx->jobs >= jobs)
+		return;
+	ctx->job_arenas = realloc(ctx->job_arenas, jobs * sizeof(struct arena *));
+	for (int i = ctx->jobs; i < jobs; ++i)
+		arena_init(&ctx->job_arenas[i], "job", 1 << 20);
+	ctx->jobs = jobs;
+}
+
+/*
+ * Compiles the whole file with the work spread over a pool of jobs
+ * threads, each allocating from an arena of its own.
+ */
+int parallel(struct context *ctx, FILE *fp, int jobs) {
+	struct thread_pool *pool;
+	if (scan(ctx, fp) == -1)
+		return -1;
+	job_arenas(ctx, jobs);
+	pool_init(&pool, jobs);
+	parse_parallel(ctx, pool);
+	out_parallel(ctx, pool);
+	pool_destroy(pool);
+	return 0;
+}
+
+/*
+ * Code generation alone, from a file written by --emit-ast.
+ */
+int from_ast(struct context *ctx, FILE *fp, int jobs) {
+	struct thread_pool *pool;
+	ast_load(ctx, fp);
+	if (jobs == 0)
+		return out(ctx);
+	pool_init(&pool, jobs);
+	out_parallel(ctx, pool);
+	pool_destroy(pool);
+	return 0;
+}
+
+int lazy(struct context *ctx, FILE *fp, char** entries, int entry_count) {
+	if (scan(ctx, fp) == -1)
+		return -1;
+	parse_lazy(ctx, entries, entry_count);
+	out(ctx);
+	return 0;
+}
+
+_Thread_local struct compile_job *cur_job;
+
+FILE* diag_stream() {
+	return cur_job ? cur_job->diag : stdout;
+}
+
+void compile_fail() {
+	if (cur_job)
+		longjmp(cur_job->bail, 1);
+	exit(0);
+}
+
+/*
+ * One compile in whichever mode the options pick. Assembly goes to
+ * ctx->out, errors to diag_stream().
+ */
+int compile(struct context *ctx, FILE *fp, struct options *opt) {
+	int res;
+	if (opt->from_ast)
+		res = from_ast(ctx, fp, opt->jobs);
+	else if (opt->emit_ast) {
+		if ((res = scan(ctx, fp)) != -1 && (res = parse(ctx)) != -1)
+			res = ast_save(ctx, opt->emit_ast);
+	} else if (opt->cache_dir)
+		res = incremental(ctx, fp, opt->cache_dir, opt->cache_limit);
+	else if (opt->lazily)
+		res = lazy(ctx, fp, opt->entries, opt->entry_count);
+	else if (opt->jobs > 0)
+		res = parallel(ctx, fp, opt->jobs);
+	else if (opt->piped)
+		res = pipeline(ctx, fp);
+	else if (opt->streaming)
+		res = stream(ctx, fp);
+	else if ((res = scan(ctx, fp)) != -1 && (res = parse(ctx)) != -1)
+		res = out(ctx);
+	return res;
+}
+
+/*
+ * Only the front end of compile, for backends that need the whole
+ * program parsed. The modes that emit as they parse, and the cache of
+ * emitted code, parse in one pass here.
+ */
+int front_end(struct context *ctx, FILE *fp, struct options *opt) {
+	struct thread_pool *pool;
+	int res;
+	if (opt->from_ast) {
+		ast_load(ctx, fp);
 		return 0;
-	struct context *ctx = calloc(1, sizeof(struct context));
+	}
 	if (scan(ctx, fp) == -1)
-		printf("SCAN ERROR\n");
-	else if (parse(ctx) == -1)
-		printf("PARSE ERROR\n");
-	else if (out(ctx) == -1)
-		printf("OUTPUT ERROR\n");
+		return -1;
+	if (opt->lazily)
+		res = parse_lazy(ctx, opt->entries, opt->entry_count);
+	else if (opt->jobs > 0) {
+		job_arenas(ctx, opt->jobs);
+		pool_init(&pool, opt->jobs);
+		res = parse_parallel(ctx, pool);
+		pool_destroy(pool);
+	} else
+		res = parse(ctx);
+	return res;
+}
+
+struct batch_file {
+	char* in;
+	char* out;
+	char* diag;
+	size_t diag_len;
+	int failed;
+	double time;
+};
+
+struct batch {
+	struct options *opt;
+	struct batch_file *files;
+};
+
+/*
+ * Compiles one file of a batch in a context of its own. An error
+ * unwinds back here; whatever the phases left behind is released
+ * with the context and the partial output is removed.
+ */
+void batch_job(void* arg, size_t i, int worker) {
+	struct batch *batch = arg;
+	struct batch_file *file = &batch->files[i];
+	struct context *ctx = calloc(1, sizeof(struct context));
+	struct compile_job job;
+	double start = wall_time();
+	FILE* fp;
+	job.diag = open_memstream(&file->diag, &file->diag_len);
+	if ((fp = fopen(file->in, "r")) == NULL) {
+		fprintf(job.diag, "cannot open %s\n", file->in);
+		file->failed = 1;
+	} else if ((ctx->out = fopen(file->out, "w")) == NULL) {
+		fprintf(job.diag, "cannot write %s\n", file->out);
+		file->failed = 1;
+	} else {
+		cur_job = &job;
+		if (setjmp(job.bail) || compile(ctx, fp, batch->opt) == -1)
+			file->failed = 1;
+		cur_job = NULL;
+	}
+	if (ctx->parser)
+		parse_end(ctx);
+	if (ctx->emitter)
+		out_abort(ctx);
+	if (ctx->out) {
+		fclose(ctx->out);
+		if (file->failed)
+			remove(file->out);
+	}
+	if (fp)
+		fclose(fp);
+	context_release(ctx);
+	fclose(job.diag);
+	file->time = wall_time() - start;
+}
+
+/*
+ * Response files list one "input output" pair per line.
+ */
+int read_response(char* path, struct options *opt) {
+	char in[4096], out[4096];
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (fscanf(fp, "%4095s %4095s", in, out) == 2) {
+		opt->files = realloc(opt->files,
+				(opt->file_count + 2) * sizeof(char*));
+		opt->files[opt->file_count++] = strdup(in);
+		opt->files[opt->file_count++] = strdup(out);
+	}
+	fclose(fp);
 	return 0;
 }
+
+/*
+ * Compiles every input/output pair on a pool of --jobs workers, one
+ * file per job, then reports each file in the order given.
+ */
+int run_batch(struct options *opt) {
+	struct options file_opt = *opt;
+	struct batch batch = { &file_opt };
+	struct thread_pool *pool;
+	size_t count = opt->file_count / 2;
+	int failed = 0;
+	file_opt.jobs = 0;
+	file_opt.piped = 0;
+	batch.files = calloc(count, sizeof(struct batch_file));
+	for (size_t i = 0; i < count; ++i) {
+		batch.files[i].in = opt->files[2 * i];
+		batch.files[i].out = opt->files[2 * i + 1];
+	}
+	pool_init(&pool, opt->jobs > 0 ? opt->jobs : 1);
+	pool_run(pool, count, batch_job, &batch);
+	pool_destroy(pool);
+	for (size_t i = 0; i < count; ++i) {
+		struct batch_file *file = &batch.files[i];
+		fprintf(stderr, "%-4s %s -> %s (%.3f s)\n",
+				file->failed ? "FAIL" : "ok", file->in, file->out, file->time);
+		fwrite(file->diag, 1, file->diag_len, stderr);
+		failed |= file->failed;
+		free(file->diag);
+	}
+	free(batch.files);
+	return failed;
+}
+
+/*
+ * Fills opt from a command line; argv[0] is skipped. Returns -1 when
+ * a response file cannot be read or the options do not go together.
+ */
+int parse_options(struct options *opt, int argc, char **argv) {
+	opt->entries = malloc((argc + 1) * sizeof(char*));
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--stats"))
+			opt->stats = 1;
+		else if (!strcmp(argv[i], "--stream"))
+			opt->streaming = 1;
+		else if (!strcmp(argv[i], "--pipeline"))
+			opt->piped = 1;
+		else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+			opt->jobs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--lazy"))
+			opt->lazily = 1;
+		else if (!strcmp(argv[i], "--entry") && i + 1 < argc)
+			opt->entries[opt->entry_count++] = argv[++i];
+		else if (!strcmp(argv[i], "-c"))
+			opt->assemble = 1;
+		else if (!strcmp(argv[i], "--link"))
+			opt->link = 1;
+		else if (!strcmp(argv[i], "--integrated-as"))
+			opt->integrated = 1;
+		else if (!strcmp(argv[i], "--run"))
+			opt->run = 1;
+		else if (!strcmp(argv[i], "--interp"))
+			opt->interp = 1;
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			opt->output = argv[++i];
+		else if (!strcmp(argv[i], "--emit-ast") && i + 1 < argc)
+			opt->emit_ast = argv[++i];
+		else if (!strcmp(argv[i], "--from-ast"))
+			opt->from_ast = 1;
+		else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+			opt->cache_dir = argv[++i];
+		else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc)
+			opt->cache_limit = (size_t)atol(argv[++i]) << 20;
+		else if (!strcmp(argv[i], "--batch"))
+			opt->batch = 1;
+		else if (opt->batch && argv[i][0] == '@') {
+			if (read_response(argv[i] + 1, opt) == -1) {
+				fprintf(stderr, "cannot read %s\n", argv[i] + 1);
+				return -1;
+			}
+		} else if (opt->batch) {
+			opt->files = realloc(opt->files,
+					(opt->file_count + 1) * sizeof(char*));
+			opt->files[opt->file_count++] = strdup(argv[i]);
+		} else
+			opt->path = argv[i];
+	}
+	if (opt->batch && (opt->assemble || opt->link || opt->run
+				|| opt->interp)) {
+		fprintf(stderr, "--batch cannot be used with -c, --link, "
+				"--run or --interp\n");
+		return -1;
+	}
+	if (opt->entry_count == 0)
+		opt->entries[opt->entry_count++] = "main";
+	if (opt->cache_limit == 0)
+		opt->cache_limit = CACHE_LIMIT;
+	return 0;
+}
+
+void options_release(struct options *opt) {
+	for (int i = 0; i < opt->file_count; ++i)
+		free(opt->files[i]);
+	free(opt->files);
+	free(opt->entries);
+}
+
+int main(int argc, char **argv) {
+	struct options opt = { 0 };
+	int res = 0;
+	if (argc > 2 && !strcmp(argv[1], "--serve"))
+		return serve(argv[2]);
+	if (argc > 2 && !strcmp(argv[1], "--connect"))
+		return connect_server(argv[2], argc - 2, argv + 2);
+	if (parse_options(&opt, argc, argv) == -1)
+		res = 1;
+	else if (opt.batch) {
+		if (opt.file_count % 2) {
+			fprintf(stderr, "batch needs input/output pairs\n");
+			res = 1;
+		} else
+			res = run_batch(&opt);
+	} else if (opt.path != NULL) {
+		FILE* fp = fopen(opt.path, "r");
+		FILE* out = stdout;
+		if (fp != NULL && (opt.assemble || opt.link || opt.run
+					|| opt.interp)) {
+			struct context *ctx = calloc(1, sizeof(struct context));
+			double start = wall_time();
+			if (opt.interp)
+				res = interp(ctx, fp, &opt);
+			else if (opt.run)
+				res = jit_run(ctx, fp, &opt);
+			else
+				res = build(ctx, fp, &opt);
+			fflush(stdout);
+			if (opt.stats)
+				report_stats(ctx, wall_time() - start);
+			context_release(ctx);
+		} else if (fp != NULL && opt.output && (out = fopen(opt.output, "w")) == NULL) {
+			fprintf(stderr, "cannot write %s\n", opt.output);
+			res = 1;
+		} else if (fp != NULL) {
+			struct context *ctx = calloc(1, sizeof(struct context));
+			double start = wall_time();
+			ctx->out = out;
+			compile(ctx, fp, &opt);
+			fflush(stdout);
+			if (opt.stats)
+				report_stats(ctx, wall_time() - start);
+			if (out != stdout)
+				fclose(out);
+			context_release(ctx);
+		}
+		if (fp != NULL)
+			fclose(fp);
+	}
+	options_release(&opt);
+	return res;
+}
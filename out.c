@@ -1,33 +1,144 @@
+#include <errno.h>
+#include <unistd.h>
 #include "comp.h"
-#define RCX "%rcx"
-#define RAX "%rax"
+
+#define OUT_FLUSH (1 << 20)
+#define ob_lit(buf, s) ob_put(buf, s, sizeof(s) - 1)
+#define ob_code(buf, ...) do { \
+	static const uint8_t code_[] = { __VA_ARGS__ }; \
+	ob_put(buf, (const char*)code_, sizeof(code_)); \
+} while (0)
+
+// numbered as in the x86-64 register encoding
+enum reg {RAX = 0, RCX = 1};
+
+static const char* reg_names[] = { "%rax", "%rcx" };
 
 enum out_err { OE_NON=0, OE_NIMP, OE_MISS_SYM, OE_ASS_GEN, OE_OP_GEN};
 
+/*
+ * Assembly is appended to one buffer and handed to write(2) a block
+ * of OUT_FLUSH bytes at a time. A buffer with fd -1 keeps all of its
+ * text instead, for callers that want it back. With obj set the
+ * emitter encodes machine code into the buffer instead of text, and
+ * the buffer is kept until the object file is written around it.
+ */
+struct out_buf {
+	char* data;
+	size_t len;
+	size_t cap;
+	int fd;
+};
+
 struct out_ctx {
-	FILE* str;
+	struct out_buf buf;
+	struct elf_obj *obj;
+	struct ast_pool *ast;
+	struct sym_vec *symbols;
 	struct ast_node *last;
 	enum out_err err;
-	struct hashtable *syms;
+	struct idx_vec funcs;
+	struct sym_vec unit_syms;
 	uint64_t stack;
 };
 
-void output_op(struct out_ctx *ctx, struct ast_node *node);
-void output_lit(struct out_ctx *ctx, struct ast_node *node);
-void output_expr(struct out_ctx *ctx, struct ast_node *node);
+struct sym_ent *node_sym(struct out_ctx *ctx, struct ast_node *node) {
+	return ctx->symbols->buff[node->sym];
+}
+
+char* node_name(struct out_ctx *ctx, struct ast_node *node) {
+	return node_sym(ctx, node)->name;
+}
+
+/*
+ * Short writes are continued. Anything else fails the compile rather
+ * than leave the output cut short without a word.
+ */
+void ob_flush(struct out_buf *buf) {
+	size_t done = 0;
+	ssize_t n;
+	while (done < buf->len) {
+		n = write(buf->fd, buf->data + done, buf->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			buf->len = 0;
+			fprintf(diag_stream(), "Cannot write output: %s\n",
+					n < 0 ? strerror(errno) : "nothing written");
+			compile_fail();
+		}
+		done += n;
+	}
+	buf->len = 0;
+}
+
+static inline char* ob_room(struct out_buf *buf, size_t size) {
+	if (buf->cap - buf->len >= size)
+		return buf->data + buf->len;
+	if (buf->fd >= 0)
+		ob_flush(buf);
+	if (buf->cap - buf->len < size) {
+		buf->cap = buf->cap ? buf->cap * 2 : OUT_FLUSH;
+		if (buf->cap < buf->len + size)
+			buf->cap = buf->len + size;
+		buf->data = realloc(buf->data, buf->cap);
+	}
+	return buf->data + buf->len;
+}
+
+static inline void ob_put(struct out_buf *buf, const char* s, size_t size) {
+	memcpy(ob_room(buf, size), s, size);
+	buf->len += size;
+}
+
+static inline void ob_str(struct out_buf *buf, const char* s) {
+	ob_put(buf, s, strlen(s));
+}
+
+void ob_uint(struct out_buf *buf, uint64_t val) {
+	char digits[20];
+	int i = sizeof(digits);
+	do {
+		digits[--i] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	ob_put(buf, digits + i, sizeof(digits) - i);
+}
+
+void ob_int(struct out_buf *buf, int64_t val) {
+	if (val < 0) {
+		ob_lit(buf, "-");
+		ob_uint(buf, -(uint64_t)val);
+	} else {
+		ob_uint(buf, val);
+	}
+}
 
 void out2str(struct out_ctx *ctx, const char* string) {
-	fprintf(ctx->str, "%s", string);
+	ob_str(&ctx->buf, string);
+}
+
+void ob_u32(struct out_buf *buf, uint32_t val) {
+	char le[4] = { val, val >> 8, val >> 16, val >> 24 };
+	ob_put(buf, le, sizeof(le));
 }
 
 void push(struct out_ctx* ctx) {
-	fprintf(ctx->str, "%s", "pushq\t%rax\n");
-	ctx->stack += 8;
+	if (ctx->obj)
+		ob_code(&ctx->buf, 0x50 + RAX);
+	else
+		ob_lit(&ctx->buf, "pushq\t%rax\n");
 }
 
-void pop(struct out_ctx* ctx, char* reg) {
-	fprintf(ctx->str, "popq\t%s\n", reg);
-	ctx->stack -= 8;
+void pop(struct out_ctx* ctx, enum reg reg) {
+	if (ctx->obj) {
+		char code = 0x58 + reg;
+		ob_put(&ctx->buf, &code, 1);
+		return;
+	}
+	ob_lit(&ctx->buf, "popq\t");
+	ob_str(&ctx->buf, reg_names[reg]);
+	ob_lit(&ctx->buf, "\n");
 }
 
 void out_err(struct out_ctx *ctx) {
@@ -37,7 +148,7 @@ void out_err(struct out_ctx *ctx) {
 			sprintf(str, "Not implemented AST node type: %d", ctx->last->type);
 			break;
 		case OE_MISS_SYM:
-			sprintf(str, "Missing symbol %s", ctx->last->ident);
+			sprintf(str, "Missing symbol %s", node_name(ctx, ctx->last));
 			break;
 		case OE_ASS_GEN:
 			sprintf(str, "Assignment error");
@@ -50,16 +161,24 @@ void out_err(struct out_ctx *ctx) {
 			sprintf(str, "Unknown error type");
 			break;
 	}
-	printf("Output error: %s\n", str);
+	fprintf(diag_stream(), "Output error: %s\n", str);
 	free(str);
-	exit(0);
+	compile_fail();
 }
 
 void output_lit(struct out_ctx *ctx, struct ast_node *node) {
 	ctx->last = node;
 	switch (node->type) {
 		case AST_INT:
-			fprintf(ctx->str, "movq\t$%d, %%rax\n", node->int_val);
+			if (ctx->obj) {
+				// movq $imm32, %rax
+				ob_code(&ctx->buf, 0x48, 0xc7, 0xc0);
+				ob_u32(&ctx->buf, node->int_val);
+				break;
+			}
+			ob_lit(&ctx->buf, "movq\t$");
+			ob_int(&ctx->buf, node->int_val);
+			ob_lit(&ctx->buf, ", %rax\n");
 			break;
 		default:
 			out_err(ctx);
@@ -67,42 +186,94 @@ void output_lit(struct out_ctx *ctx, struct ast_node *node) {
 	}
 }
 
+/*
+ * Assigns stack slots ahead of emission, tracking the depth every
+ * push and pop will leave behind. An assignment names the slot its
+ * value was just pushed to; a read keeps its distance from the top
+ * in count. Emitting a node then needs nothing outside the node.
+ */
+void output_layout(struct out_ctx *ctx, uint32_t start, uint32_t end) {
+	struct ast_node *node;
+	for (uint32_t i = start; i < end; ++i) {
+		node = &ctx->ast->buff[i];
+		switch (node->type) {
+			case AST_OP:
+				ctx->stack -= 16;
+				break;
+			case AST_ASS:
+				node_sym(ctx, node)->stack = ctx->stack;
+				break;
+			case AST_VAR:
+				node->count = ctx->stack - node_sym(ctx, node)->stack;
+				break;
+			case AST_ARGS:
+				i = node->end - 1;
+				continue;
+			case AST_INT:
+			case AST_CALL:
+				break;
+			default:
+				continue;
+		}
+		ctx->stack += 8;
+	}
+}
+
+/*
+ * movq disp(%rsp), %rax takes a SIB byte, and the shortest of no,
+ * 8-bit and 32-bit displacement, like the assembler picks.
+ */
+void output_var_code(struct out_ctx *ctx, struct ast_node *node) {
+	char disp = node->count;
+	if (node->count == 0) {
+		ob_code(&ctx->buf, 0x48, 0x8b, 0x04, 0x24);
+	} else if (node->count < 0x80) {
+		ob_code(&ctx->buf, 0x48, 0x8b, 0x44, 0x24);
+		ob_put(&ctx->buf, &disp, 1);
+	} else {
+		ob_code(&ctx->buf, 0x48, 0x8b, 0x84, 0x24);
+		ob_u32(&ctx->buf, node->count);
+	}
+}
+
 void output_var(struct out_ctx *ctx, struct ast_node *node) {
-	struct sym_ent *se;
-	ctx->last = node;
-	if ((se = ht_find(ctx->syms, node->ident)) == NULL) {
-		ctx->err = OE_MISS_SYM;
-		ctx->last = node->left;
-		out_err(ctx);
+	if (ctx->obj) {
+		output_var_code(ctx, node);
 		return;
 	}
-	uint64_t diff = ctx->stack - se->stack;
-	fprintf(ctx->str, "movq\t%lu(%%rsp), %%rax\n",diff);
+	ob_lit(&ctx->buf, "movq\t");
+	ob_uint(&ctx->buf, node->count);
+	ob_lit(&ctx->buf, "(%rsp), %rax\n");
 }
 
-void output_ass(struct out_ctx *ctx, struct ast_node *node) {
-	output_expr(ctx, node->right);
-	if (node->left->type = AST_VAR) {
-		struct sym_ent *se = ht_find(ctx->syms, node->left->ident);
-		if (se) {
-			se->stack = ctx->stack;
-		} else {
-			ctx->err = OE_MISS_SYM;
-			ctx->last = node->left;
+void output_op_code(struct out_ctx *ctx, struct ast_node *node) {
+	switch (node->char_val) {
+		case '+':
+			ob_code(&ctx->buf, 0x48, 0x01, 0xc8);
+			break;
+		case '-':
+			ob_code(&ctx->buf, 0x48, 0x29, 0xc8);
+			break;
+		case '*':
+			ob_code(&ctx->buf, 0x48, 0x0f, 0xaf, 0xc1);
+			break;
+		case '/':
+			ob_code(&ctx->buf, 0x48, 0x99, 0x48, 0xf7, 0xf9);
+			break;
+		default:
+			ctx->err = OE_OP_GEN;
 			out_err(ctx);
-		}
-	} else {
-		ctx->err = OE_ASS_GEN;
-		out_err(ctx);
+			break;
 	}
 }
 
 void output_op(struct out_ctx *ctx, struct ast_node *node) {
-	ctx->last = node;
-	output_expr(ctx, node->left);
-	output_expr(ctx, node->right);
 	pop(ctx, RCX); // right
 	pop(ctx, RAX); // left
+	if (ctx->obj) {
+		output_op_code(ctx, node);
+		return;
+	}
 	switch (node->char_val) {
 		case '+':
 			out2str(ctx, "addq\t%rcx, %rax\n");
@@ -124,23 +295,64 @@ void output_op(struct out_ctx *ctx, struct ast_node *node) {
 }
 
 void output_func(struct out_ctx *ctx, struct ast_node *node) {
-	fprintf(ctx->str, "%sPRE:\n.globl %s\n.type %s, @function\n%s:\n",
-			node->ident, node->ident, node->ident, node->ident);
-	out2str(ctx, "pushq\t%rbp\nmovq\t%rsp, %rbp\n");
-	struct ast_node *next;
-	while ((next = vector_next(node->many)) != NULL) {
-		output_expr(ctx, next);
+	char* name = node_name(ctx, node);
+	size_t len = strlen(name);
+	if (ctx->obj) {
+		// pushq %rbp; movq %rsp, %rbp
+		elf_func_begin(ctx->obj, name, ctx->buf.len);
+		ob_code(&ctx->buf, 0x55, 0x48, 0x89, 0xe5);
+		return;
 	}
-	out2str(ctx, "popq\t%rax\nmovq\t%rbp,%rsp\npopq\t%rbp\nret\n");
-	fprintf(ctx->str, "%sPOST:\n.size %s, .-%s\n.section .rodata\n",
-			node->ident, node->ident, node->ident);
+	// the previous function switched to .rodata on its way out
+	ob_lit(&ctx->buf, ".text\n");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, "PRE:\n.globl ");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, "\n.type ");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, ", @function\n");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, ":\npushq\t%rbp\nmovq\t%rsp, %rbp\n");
+}
+
+void output_func_end(struct out_ctx *ctx, struct ast_node *node) {
+	char* name = node_name(ctx, node);
+	size_t len = strlen(name);
+	if (ctx->obj) {
+		// popq %rax; movq %rbp, %rsp; popq %rbp; ret
+		ob_code(&ctx->buf, 0x58, 0x48, 0x89, 0xec, 0x5d, 0xc3);
+		elf_func_end(ctx->obj, name, ctx->buf.len);
+		return;
+	}
+	ob_lit(&ctx->buf, "popq\t%rax\nmovq\t%rbp,%rsp\npopq\t%rbp\nret\n");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, "POST:\n.size ");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, ", .-");
+	ob_put(&ctx->buf, name, len);
+	ob_lit(&ctx->buf, "\n.section .rodata\n");
 }
 
 void output_call(struct out_ctx *ctx, struct ast_node *node) {
-	fprintf(ctx->str, "call\t%s\n", node->ident);
+	if (ctx->obj) {
+		// call rel32, filled in by the linker
+		elf_call(ctx->obj, node_name(ctx, node), ctx->buf.len + 1);
+		ob_code(&ctx->buf, 0xe8);
+		ob_u32(&ctx->buf, 0);
+		return;
+	}
+	ob_lit(&ctx->buf, "call\t");
+	ob_str(&ctx->buf, node_name(ctx, node));
+	ob_lit(&ctx->buf, "\n");
 }
 
-void output_expr(struct out_ctx *ctx, struct ast_node *node) {
+/*
+ * Emits the node at *i. Operands always come first in the pool, so
+ * each node only has to combine what is already on the stack. Call
+ * arguments are never evaluated, the AST_ARGS marker jumps past them.
+ */
+void output_node(struct out_ctx *ctx, uint32_t *i) {
+	struct ast_node *node = &ctx->ast->buff[*i];
 	ctx->last = node;
 	switch (node->type) {
 		case AST_INT:
@@ -150,17 +362,20 @@ void output_expr(struct out_ctx *ctx, struct ast_node *node) {
 			output_op(ctx, node);
 			break;
 		case AST_ASS:
-			output_ass(ctx, node);
 			break;
 		case AST_VAR:
 			output_var(ctx, node);
 			break;
 		case AST_FUNC:
 			output_func(ctx, node);
+			idx_vec_push(&ctx->funcs, *i);
 			break;
 		case AST_CALL:
 			output_call(ctx, node);
 			break;
+		case AST_ARGS:
+			*i = node->end - 1;
+			break;
 		case AST_SKIP:
 			break;
 		default:
@@ -168,22 +383,215 @@ void output_expr(struct out_ctx *ctx, struct ast_node *node) {
 			out_err(ctx);
 			break;
 	}
-	if (node->type != AST_FUNC && node->type != AST_SKIP)
+	if (node->type != AST_FUNC && node->type != AST_SKIP
+			&& node->type != AST_ARGS)
 		push(ctx);
 }
 
+void output_range(struct out_ctx *ctx, uint32_t start, uint32_t end) {
+	struct ast_node *func;
+	for (uint32_t i = start; i < end; ++i) {
+		output_node(ctx, &i);
+		while (ctx->funcs.len) {
+			func = &ctx->ast->buff[ctx->funcs.buff[ctx->funcs.len - 1]];
+			if (func->end != i + 1)
+				break;
+			output_func_end(ctx, func);
+			ctx->funcs.len--;
+		}
+	}
+}
+
 char* tmp_start = ".LC0:\n.string \"%d\\n\"\n.globl main\n.type main, @function\nmain:\npushq %rbp\nmovq %rsp,%rbp\n";
 char* tmp_end = "movl %eax,%esi\nmovl $.LC0,%edi\nmovl $0,%eax\ncall printf\nmovl $0,%eax\nleave\nret\n";
 
-int out(struct context *ctx) {
-	struct out_ctx *out_ctx = calloc(1, sizeof(struct out_ctx));
-	vector_reset(ctx->asts);
-	struct ast_node* node;
-	out_ctx->str = stdout;
-	out_ctx->syms = ctx->syms;
+void out_begin(struct context *ctx) {
+	if (ctx->out_arena == NULL)
+		arena_init(&ctx->out_arena, "out", 1 << 16);
+	struct out_ctx *out_ctx = arena_alloc(ctx->out_arena,
+			sizeof(struct out_ctx));
+	// anything already in the stream goes out ahead of our writes
+	fflush(ctx->out);
+	out_ctx->buf.fd = fileno(ctx->out);
+	out_ctx->ast = ctx->ast;
+	out_ctx->symbols = ctx->symbols;
 	out_ctx->stack = 0;
-	fprintf(out_ctx->str, ".file\t\"main.c\"\n");
-	while ((node = vector_next(ctx->asts)) != NULL) {
-		output_expr(out_ctx, node);
+	ctx->emitter = out_ctx;
+	if (ctx->machine_code) {
+		elf_init(&out_ctx->obj, ctx->out_arena, "main.c");
+		out_ctx->buf.fd = -1;
+		return;
+	}
+	ob_lit(&out_ctx->buf, ".file\t\"main.c\"\n");
+}
+
+void out_range(struct context *ctx, uint32_t start, uint32_t end) {
+	output_layout(ctx->emitter, start, end);
+	output_range(ctx->emitter, start, end);
+}
+
+/*
+ * Emits a unit from a parser running on another thread. Its symbols
+ * are collected into a table of our own, so the parser can keep
+ * growing ctx->symbols meanwhile.
+ */
+void out_unit(struct context *ctx, struct ast_unit *unit) {
+	struct out_ctx *out_ctx = ctx->emitter;
+	for (size_t i = 0; i < unit->sym_count; ++i)
+		sym_vec_push(&out_ctx->unit_syms, unit->syms[i]);
+	out_ctx->symbols = &out_ctx->unit_syms;
+	out_ctx->ast = unit->ast;
+	output_layout(out_ctx, 0, unit->ast->len);
+	output_range(out_ctx, 0, unit->ast->len);
+}
+
+/*
+ * Drops the emitter without writing what is still buffered, for
+ * compiles that failed part way.
+ */
+void out_abort(struct context *ctx) {
+	if (ctx->emitter->obj)
+		elf_destroy(ctx->emitter->obj);
+	free(ctx->emitter->buf.data);
+	free(ctx->emitter->funcs.buff);
+	free(ctx->emitter->unit_syms.buff);
+	ctx->emitter = NULL;
+}
+
+/*
+ * Writes out what is buffered so far, for output that has to be out
+ * before a message about what follows it.
+ */
+void out_flush(struct context *ctx) {
+	if (ctx->emitter->buf.fd >= 0)
+		ob_flush(&ctx->emitter->buf);
+}
+
+void out_end(struct context *ctx) {
+	struct out_ctx *out_ctx = ctx->emitter;
+	if (out_ctx->obj && ctx->jit)
+		jit_load(ctx->jit, out_ctx->obj, out_ctx->buf.data, out_ctx->buf.len);
+	else if (out_ctx->obj) {
+		if (write_elf(out_ctx->obj, fileno(ctx->out), out_ctx->buf.data,
+					out_ctx->buf.len) == -1) {
+			fprintf(diag_stream(), "Cannot write output: %s\n",
+					strerror(errno));
+			compile_fail();
+		}
+	} else {
+		ob_flush(&out_ctx->buf);
+	}
+	out_abort(ctx);
+}
+
+int out(struct context *ctx) {
+	out_begin(ctx);
+	out_range(ctx, 0, ctx->ast->len);
+	out_end(ctx);
+	return 0;
+}
+
+uint64_t out_stack(struct context *ctx) {
+	return ctx->emitter->stack;
+}
+
+/*
+ * Writes a function emitted earlier, moving the stack the way its
+ * emission did.
+ */
+void out_text(struct context *ctx, const char* text, size_t size,
+		uint64_t delta) {
+	ob_put(&ctx->emitter->buf, text, size);
+	ctx->emitter->stack += delta;
+}
+
+/*
+ * Emits a function parsed into a pool of its own and also hands back
+ * its text and stack movement, so it can be replayed by out_text.
+ */
+void out_capture(struct context *ctx, struct ast_pool *ast, char** text,
+		size_t *size, uint64_t *delta) {
+	struct out_ctx *out_ctx = ctx->emitter;
+	struct ast_pool *main = out_ctx->ast;
+	struct out_buf buf = out_ctx->buf;
+	uint64_t stack = out_ctx->stack;
+	out_ctx->ast = ast;
+	out_ctx->buf = (struct out_buf){ .fd = -1 };
+	output_layout(out_ctx, 0, ast->len);
+	output_range(out_ctx, 0, ast->len);
+	*text = out_ctx->buf.data;
+	*size = out_ctx->buf.len;
+	out_ctx->buf = buf;
+	out_ctx->ast = main;
+	ob_put(&out_ctx->buf, *text, *size);
+	*delta = out_ctx->stack - stack;
+}
+
+#define OUT_WINDOW 1024
+
+/*
+ * Pieces of the pool that can be emitted on their own: each function,
+ * and each run of top-level code between functions. Their buffers are
+ * kept from one window to the next.
+ */
+struct out_batch {
+	struct out_ctx *main;
+	struct idx_vec bounds;
+	size_t first;
+	struct out_buf *bufs;
+};
+
+void out_job(void* arg, size_t i, int worker) {
+	struct out_batch *batch = arg;
+	struct out_ctx ctx = { .ast = batch->main->ast,
+		.symbols = batch->main->symbols, .buf = batch->bufs[i] };
+	i += batch->first;
+	output_range(&ctx, batch->bounds.buff[i], batch->bounds.buff[i + 1]);
+	batch->bufs[i - batch->first] = ctx.buf;
+	free(ctx.funcs.buff);
+}
+
+/*
+ * After one layout pass over the whole pool, functions are emitted
+ * into buffers of their own on the pool, a window at a time, and the
+ * buffers are written out in source order.
+ */
+int out_parallel(struct context *ctx, struct thread_pool *pool) {
+	struct out_batch batch = { 0 };
+	struct ast_pool *ast = ctx->ast;
+	size_t count, window;
+	uint32_t i = 0;
+	out_begin(ctx);
+	batch.main = ctx->emitter;
+	batch.main->ast = ast;
+	output_layout(batch.main, 0, ast->len);
+	idx_vec_push(&batch.bounds, 0);
+	while (i < ast->len) {
+		if (ast->buff[i].type == AST_FUNC) {
+			i = ast->buff[i].end;
+		} else {
+			while (i < ast->len && ast->buff[i].type != AST_FUNC)
+				++i;
+		}
+		idx_vec_push(&batch.bounds, i);
+	}
+	count = batch.bounds.len - 1;
+	batch.bufs = calloc(OUT_WINDOW, sizeof(struct out_buf));
+	for (size_t j = 0; j < OUT_WINDOW; ++j)
+		batch.bufs[j].fd = -1;
+	for (batch.first = 0; batch.first < count; batch.first += window) {
+		window = count - batch.first < OUT_WINDOW
+			? count - batch.first : OUT_WINDOW;
+		pool_run(pool, window, out_job, &batch);
+		for (size_t j = 0; j < window; ++j) {
+			ob_put(&batch.main->buf, batch.bufs[j].data, batch.bufs[j].len);
+			batch.bufs[j].len = 0;
+		}
 	}
+	for (size_t j = 0; j < OUT_WINDOW; ++j)
+		free(batch.bufs[j].data);
+	free(batch.bufs);
+	free(batch.bounds.buff);
+	out_end(ctx);
+	return 0;
 }
@@ -2,11 +2,12 @@
 
 /*
  * GRAMMAR USED
- * Expr ::= Term Expr'
- * Expr' ::= + Term Expr' | - Term Expr' | ϵ
- * Term ::= Factor Term'
- * Term' ::= * Factor Term' | / Factor Term' | ϵ
+ * Expr ::= Factor Op Expr | Factor
  * Factor ::= (Expr) | NUM | VAR | FUNC_CALL
+ * FUNC_CALL ::= VAR ( Expr , ... )
+ *
+ * Op binds as given by op_prec. Expressions are parsed with explicit
+ * operator and operand stacks instead of one call per grammar level.
  */
 
 
@@ -15,32 +16,57 @@ enum parse_exp {P_NON = 0x0, P_IDENT = 0x1};
 enum parse_err {PE_NON = 0, PE_DUPE_VAR, PE_CONS, PE_VARB4ASS,
 				PE_SYMDNE, PE_NOTFUNC, PE_PARAMMISS};
 
+enum frame_kind {FR_OP, FR_PAREN, FR_CALL};
+
+/*
+ * Pending work on the operator stack. An FR_OP keeps its operator
+ * token, an FR_CALL the AST_ARGS marker its arguments follow.
+ */
+struct expr_frame {
+	enum frame_kind kind;
+	uint32_t pos;
+	uint32_t count;
+	struct sym_ent *se;
+};
+
+VECTOR_DEFINE(frame_vec, struct expr_frame)
+
+static const uint8_t op_prec[128] = {
+	['+'] = 1, ['-'] = 1,
+	['*'] = 2, ['/'] = 2,
+};
+
 struct parse_ctx {
-	struct vector *tokens;
-	char **types;
-	size_t types_size;
-	char **kws;
-	size_t kws_size;
+	struct arena *arena;
+	struct tok_stream *ts;
+	struct ast_pool *ast;
+	size_t pos;
 	struct hashtable *syms;
+	struct sym_vec *symbols;
+	size_t sym_taken;
+	int shared;
+	struct body_vec *bodies;
+	jmp_buf *bail;
 	enum parse_err err;
 	char* err_ex;
 	int braces;
 	int paren;
+	struct frame_vec frames;
+	struct idx_vec vals;
 };
 
-struct ast_node *expr(struct parse_ctx *ctx);
-enum var_type get_type(struct parse_ctx* ctx, struct token_node *node);
-struct ast_node *line(struct parse_ctx *ctx);
-struct ast_node *func_call(struct parse_ctx *ctx, char* ident);
-int args_cmp(struct hashtable *params, struct vector *args);
+uint32_t expr(struct parse_ctx *ctx);
+enum var_type get_type(struct parse_ctx* ctx, size_t node);
+uint32_t line(struct parse_ctx *ctx);
+int args_cmp(struct hashtable *params, uint32_t count);
 int params_cmp(struct hashtable *p0, struct hashtable *p1);
 
 /*
  * Compares parameters in form of a struct sym_ent to the args
  * in the form of struct ast_node
  */
-int args_cmp(struct hashtable *params, struct vector *args) {
-	if (params->count != args->len)
+int args_cmp(struct hashtable *params, uint32_t count) {
+	if (params->count != count)
 		return -1;
 	return 0;
 }
@@ -57,118 +83,231 @@ int params_cmp(struct hashtable *p0, struct hashtable *p1) {
 	return 0;
 }
 
-int get_ast_height(struct ast_node *ast) {
-	if (ast == NULL)
+/*
+ * First index of the subtree rooted at node. Only function bodies
+ * follow their root, everything else ends in it.
+ */
+uint32_t ast_start(struct ast_pool *pool, uint32_t node) {
+	struct ast_node *ast;
+	for (;;) {
+		ast = &pool->buff[node];
+		if (ast->type == AST_OP)
+			node = ast->left;
+		else if (ast->type == AST_ASS)
+			node = ast->right;
+		else if (ast->type == AST_CALL)
+			return ast->first;
+		else
+			return node;
+	}
+}
+
+uint32_t ast_stop(struct ast_pool *pool, uint32_t node) {
+	if (pool->buff[node].type == AST_FUNC)
+		return pool->buff[node].end;
+	return node + 1;
+}
+
+int get_ast_height(struct ast_pool *pool, uint32_t root) {
+	if (root == AST_NIL)
 		return -1;
-	int lh = get_ast_height(ast->left);
-	int rh = get_ast_height(ast->right);
-	return lh > rh ? lh + 1 : rh + 1;
+	uint32_t start = ast_start(pool, root), stop = ast_stop(pool, root);
+	int *h = calloc(stop - start, sizeof(int));
+	struct ast_node *ast;
+	int res;
+	// operands come before their parents, function bodies after
+	for (uint32_t i = start; i < stop; ++i) {
+		ast = &pool->buff[i];
+		if (ast->type == AST_OP) {
+			res = h[ast->left - start] > h[ast->right - start]
+				? h[ast->left - start] : h[ast->right - start];
+			h[i - start] = res + 1;
+		} else if (ast->type == AST_ASS) {
+			h[i - start] = h[ast->right - start] + 1;
+		} else if (ast->type == AST_CALL) {
+			for (uint32_t j = ast->first + 1; j < i; ++j)
+				if (h[j - start] + 1 > h[i - start])
+					h[i - start] = h[j - start] + 1;
+		}
+	}
+	for (uint32_t i = stop; i-- > start;) {
+		ast = &pool->buff[i];
+		if (ast->type != AST_FUNC)
+			continue;
+		for (uint32_t j = i + 1; j < ast->end; ++j)
+			if (h[j - start] + 1 > h[i - start])
+				h[i - start] = h[j - start] + 1;
+	}
+	res = h[root - start];
+	free(h);
+	return res;
 }
 
-void print_ast(struct ast_node *ast, int indent) {
-	if (ast == NULL)
+/*
+ * Dumps a tree in storage order, operands above their operator and
+ * indented by depth.
+ */
+void print_ast(struct ast_pool *pool, struct sym_vec *symbols,
+		uint32_t root, int indent) {
+	if (root == AST_NIL)
 		return;
-	print_ast(ast->right, indent + 8);
-	for (int i = 0; i < indent; ++i)
-		printf(" ");
-	if (ast->type == AST_INT)
-		printf("%d\n", ast->int_val);
-	else if (ast->type == AST_OP || ast->type == AST_ASS)
-		printf("%c\n", ast->char_val);
-	else if (ast->type == AST_VAR)
-		printf("var:%s\n", ast->ident);
-	print_ast(ast->left, indent + 8);
+	uint32_t start = ast_start(pool, root), stop = ast_stop(pool, root);
+	int *depth = calloc(stop - start, sizeof(int));
+	struct ast_node *ast;
+	depth[root - start] = indent;
+	for (uint32_t i = start; i < stop; ++i) {
+		ast = &pool->buff[i];
+		if (ast->type == AST_FUNC)
+			for (uint32_t j = i + 1; j < ast->end; ++j)
+				depth[j - start] = depth[i - start] + 8;
+	}
+	for (uint32_t i = stop; i-- > start;) {
+		ast = &pool->buff[i];
+		if (ast->type == AST_OP) {
+			depth[ast->left - start] = depth[i - start] + 8;
+			depth[ast->right - start] = depth[i - start] + 8;
+		} else if (ast->type == AST_ASS) {
+			depth[ast->right - start] = depth[i - start] + 8;
+		} else if (ast->type == AST_CALL) {
+			for (uint32_t j = ast->first + 1; j < i; ++j)
+				depth[j - start] = depth[i - start] + 8;
+		}
+	}
+	for (uint32_t i = start; i < stop; ++i) {
+		ast = &pool->buff[i];
+		if (ast->type == AST_ARGS || ast->type == AST_SKIP)
+			continue;
+		for (int j = 0; j < depth[i - start]; ++j)
+			printf(" ");
+		if (ast->type == AST_INT)
+			printf("%d\n", ast->int_val);
+		else if (ast->type == AST_OP)
+			printf("%c\n", ast->char_val);
+		else if (ast->type == AST_ASS)
+			printf("%c var:%s\n", ast->char_val, symbols->buff[ast->sym]->name);
+		else if (ast->type == AST_VAR)
+			printf("var:%s\n", symbols->buff[ast->sym]->name);
+		else if (ast->type == AST_CALL)
+			printf("call:%s\n", symbols->buff[ast->sym]->name);
+		else if (ast->type == AST_FUNC)
+			printf("func:%s\n", symbols->buff[ast->sym]->name);
+	}
+	free(depth);
 }
 
 void err_abort(struct parse_ctx *ctx) {
-	struct token_node* node = vector_peek(ctx->tokens);
+	size_t node = ctx->pos;
+	if (ctx->bail)
+		longjmp(*ctx->bail, 1);
+	FILE* diag = diag_stream();
 	char* str = calloc(1000, sizeof(char));
-	token_str(node, str);
-	printf("Parse error next token: %s", str);
+	token_str(ctx->ts, node, str);
+	fprintf(diag, "Parse error next token: %s", str);
 	free(str);
 	switch (ctx->err) {
 		case PE_DUPE_VAR:
-			printf(" (Duplicate assignment) ");
+			fprintf(diag, " (Duplicate assignment) ");
 			break;
 		case PE_CONS:
-			printf(" (Consume error) ");
+			fprintf(diag, " (Consume error) ");
 			break;
 		case PE_VARB4ASS:
-			printf(" (Variable %s used before assignment) ", ctx->err_ex);
+			fprintf(diag, " (Variable %s used before assignment) ", ctx->err_ex);
 			break;
 		case PE_SYMDNE:
-			printf(" (Symbol %s not in scope) ", ctx->err_ex);
+			fprintf(diag, " (Symbol %s not in scope) ", ctx->err_ex);
 			break;
 		case PE_NOTFUNC:
-			printf(" (Symbol %s not a function) ", ctx->err_ex);
+			fprintf(diag, " (Symbol %s not a function) ", ctx->err_ex);
 			break;
 		case PE_PARAMMISS:
-			printf(" (Parameter mismatch) ");
+			fprintf(diag, " (Parameter mismatch) ");
 			break;
 		default:
-			printf(" (%s) ", ctx->err_ex);
+			fprintf(diag, " (%s) ", ctx->err_ex);
 			break;
 	}
-	printf("LINE: %lu\n", node->line);
-	exit(0);
+	fprintf(diag, "LINE: %lu\n", ts_line(ctx->ts, node));
+	compile_fail();
 }
 
-struct sym_ent *get_sym(struct parse_ctx *ctx, char* ident) {
-	struct sym_ent *res;
-	if ((res = ht_find(ctx->syms, ident)) == NULL) {
-		ctx->err = PE_SYMDNE;
-		ctx->err_ex = ident;
-		err_abort(ctx);
-	}
-	return res;
+/*
+ * Symbols that AST nodes can refer to get an id, so code generation
+ * reaches them by index instead of looking names up again.
+ */
+struct sym_ent *make_sym(struct parse_ctx *ctx, enum var_type type,
+		char* name) {
+	struct sym_ent *se = arena_alloc(ctx->arena, sizeof(struct sym_ent));
+	se->type = type;
+	se->name = name;
+	se->id = ctx->symbols->len;
+	se->decl = ctx->pos;
+	sym_vec_push(ctx->symbols, se);
+	ht_insert(ctx->syms, name, se);
+	return se;
 }
 
-struct ast_node *make_ast_var_node(enum var_type type, char* ident) {
-	struct ast_node* res = calloc(1, sizeof(struct ast_node));
-	res->vtype = type;
-	res->ident = ident;
-	res->type = AST_VAR;
-	res->left = NULL;
-	res->right = NULL;
-	return res;
+/*
+ * The whole file shares one table, as in a single pass over it. A body
+ * parsed out of order finds names declared further down already
+ * entered, so a name only counts once its declaration is behind the
+ * point of use.
+ */
+struct sym_ent *find_sym(struct parse_ctx *ctx, char* name) {
+	struct sym_ent *se = ht_find(ctx->syms, name);
+	if (se != NULL && se->decl >= ctx->pos)
+		return NULL;
+	return se;
 }
 
-struct ast_node *make_ast_skip_node() {
-	struct ast_node* res = calloc(1, sizeof(struct ast_node));
-	res->type = AST_SKIP;
-	return res;
+uint32_t ast_push(struct parse_ctx *ctx, struct ast_node ast) {
+	ast_pool_push(ctx->ast, ast);
+	return ctx->ast->len - 1;
+}
+
+uint32_t make_ast_var_node(struct parse_ctx *ctx, struct sym_ent *se) {
+	struct ast_node res = { .type = AST_VAR, .vtype = se->type,
+		.sym = se->id };
+	return ast_push(ctx, res);
 }
 
-struct ast_node *make_ast_node(struct token_node* node,
-		struct ast_node *left, struct ast_node *right) {
-	struct ast_node* res = calloc(1, sizeof(struct ast_node));
-	if (node->type == TK_INT) {
-		res->type = AST_INT;
-		res->int_val = node->int_val;
-	} else if (node->type == TK_OP) {
-		res->type = AST_OP;
-		res->char_val = node->char_val;
-	} else if (node->type == TK_ASS) {
-		res->type = AST_ASS;
-		res->char_val = node->char_val;
+uint32_t make_ast_skip_node(struct parse_ctx *ctx) {
+	struct ast_node res = { .type = AST_SKIP };
+	return ast_push(ctx, res);
+}
+
+uint32_t make_ast_node(struct parse_ctx *ctx, size_t node, uint32_t left,
+		uint32_t right) {
+	struct ast_node res = { 0 };
+	enum token type = ts_type(ctx->ts, node);
+	if (type == TK_INT) {
+		res.type = AST_INT;
+		res.int_val = ts_int(ctx->ts, node);
+		return ast_push(ctx, res);
+	} else if (type == TK_OP) {
+		res.type = AST_OP;
+		res.char_val = ts_char(ctx->ts, node);
+	} else if (type == TK_ASS) {
+		res.type = AST_ASS;
+		res.char_val = ts_char(ctx->ts, node);
 	}
-	res->left = left;
-	res->right = right;
-	return res;
+	res.left = left;
+	res.right = right;
+	return ast_push(ctx, res);
 }
 
 int consume(struct parse_ctx *ctx, uint64_t val) {
-	struct token_node* node = vector_peek(ctx->tokens);
-	if (node == NULL)
+	size_t node = ctx->pos;
+	if (ts_type(ctx->ts, node) == TK_NON)
 		err_abort(ctx);
 #ifdef PAR_DBG
 	char *str = calloc(1024, sizeof(char));
-	token_str(node, str);
+	token_str(ctx->ts, node, str);
 	printf("CONSUME %s\n", str);
 	free(str);
 #endif
-	if (node->type & val) {
-		vector_next(ctx->tokens);
+	if (ts_type(ctx->ts, node) & val) {
+		ctx->pos++;
 		return 0;
 	}
 	ctx->err = PE_CONS;
@@ -177,269 +316,311 @@ int consume(struct parse_ctx *ctx, uint64_t val) {
 }
 
 
-struct ast_node *factor(struct parse_ctx *ctx) {
-	struct token_node *next, *node = vector_peek(ctx->tokens);
-	struct ast_node *res = NULL;
-	struct sym_ent *se;
-	
-	if (node->type == TK_LPAREN) {
-		consume(ctx, TK_LPAREN);
-		res = expr(ctx);
-		consume(ctx, TK_RPAREN);
-	} else if (node->type == TK_TEXT) {
-		consume(ctx, TK_TEXT);
-		char* name = node->str_val;
-		if ((se = ht_find(ctx->syms, name)) == NULL) {
-			ctx->err = PE_VARB4ASS;
-			ctx->err_ex = name;
-			err_abort(ctx);
-		} else {
-			next = vector_peek(ctx->tokens);
-			if (next->type == TK_LPAREN) {
-				consume(ctx, TK_LPAREN);
-				return func_call(ctx, se->name);
-			} else {
-				return make_ast_var_node(se->type, se->name);
-			}
-		}
-	} else if (node->type == TK_INT) {
-		consume(ctx, TK_INT);
-		return make_ast_node(node, NULL, NULL);
-	}
-	return res;
-};
+int prec(struct parse_ctx *ctx, size_t node) {
+	if (ts_type(ctx->ts, node) != TK_OP)
+		return 0;
+	return op_prec[ts_char(ctx->ts, node) & 0x7F];
+}
 
-struct ast_node *term_prime(struct parse_ctx *ctx,
-		struct ast_node *left) {
-	struct ast_node *f, *tp, *res = left;
-	struct token_node *next = vector_peek(ctx->tokens);
-	while (next && next->type == TK_OP
-			&& (next->char_val == '*' || next->char_val == '/')
-			&& !consume(ctx, TK_OP)) {
-		f = factor(ctx);
-		if (f == NULL)
-			err_abort(ctx);
-		res = make_ast_node(next, res, f);
-		next = vector_peek(ctx->tokens);
+/*
+ * Folds operators down to the innermost paren or call that binds at
+ * least as tight as min_prec. Everything is left associative.
+ */
+void reduce(struct parse_ctx *ctx, size_t base, int min_prec) {
+	struct expr_frame *top;
+	uint32_t left, right;
+	while (ctx->frames.len > base) {
+		top = &ctx->frames.buff[ctx->frames.len - 1];
+		if (top->kind != FR_OP || prec(ctx, top->pos) < min_prec)
+			break;
+		right = ctx->vals.buff[--ctx->vals.len];
+		left = ctx->vals.buff[--ctx->vals.len];
+		ctx->frames.len--;
+		idx_vec_push(&ctx->vals, make_ast_node(ctx, top->pos, left, right));
 	}
-	return res;
 }
 
-struct ast_node *term(struct parse_ctx *ctx) {
-	struct ast_node *f = factor(ctx);
-	if (f == NULL)
+void call_begin(struct parse_ctx *ctx, struct sym_ent *se) {
+	struct expr_frame fr = { .kind = FR_CALL, .se = se };
+	if (!se->func) {
+		ctx->err = PE_NOTFUNC;
+		ctx->err_ex = se->name;
 		err_abort(ctx);
-	struct ast_node *tp = term_prime(ctx, f);
-	if (tp == NULL)
-		return f;
-	return tp;
-}
-
-struct ast_node *expr_prime(struct parse_ctx *ctx,
-		struct ast_node *left) {
-	struct ast_node *t, *ep, *res = left;
-	struct token_node *next = vector_peek(ctx->tokens);
-	while (next && next->type == TK_OP && (next->char_val == '+'
-				|| next->char_val == '-') && !consume(ctx, TK_OP))
-	{
-		t = term(ctx);
-		res = make_ast_node(next, res, t);
-		next = vector_peek(ctx->tokens);
 	}
-	return res;
+	fr.pos = ast_push(ctx, (struct ast_node){ .type = AST_ARGS });
+	frame_vec_push(&ctx->frames, fr);
 }
 
-struct ast_node *expr(struct parse_ctx *ctx) {
-	struct ast_node *f = term(ctx);
-	if (f == NULL)
+void call_end(struct parse_ctx *ctx) {
+	struct expr_frame fr = ctx->frames.buff[--ctx->frames.len];
+	struct ast_node res = { .type = AST_CALL, .vtype = fr.se->ret_type,
+		.sym = fr.se->id, .first = fr.pos, .count = fr.count };
+	if (args_cmp(fr.se->params, fr.count)) {
+		ctx->err = PE_PARAMMISS;
 		err_abort(ctx);
-	struct ast_node *ep = expr_prime(ctx, f);
-	if (ep == NULL)
-		return f;
-	return ep;
-}
-
-enum var_type get_type(struct parse_ctx* ctx, struct token_node *node) {
-	if (node->type != TK_TEXT)
-		return 0;
-	for
-(size_t i = 0;
-		i < ctx->types_size;
-		++i) {
-		if (!strcmp(ctx->types[i], node->str_val)) {
-			return i + 1;
-		}
 	}
-	return 0;
+	consume(ctx, TK_RPAREN);
+	ctx->ast->buff[fr.pos].end = ctx->ast->len;
+	// the arguments are reached through the AST_ARGS range, not as operands
+	ctx->vals.len -= fr.count;
+	idx_vec_push(&ctx->vals, ast_push(ctx, res));
 }
 
-enum keyword get_kw(struct parse_ctx* ctx, struct token_node *node) {
-	if (node->type != TK_TEXT)
-		return 0;
-	for (int i = 0; i < ctx->kws_size; ++i) {
-		if (!strcmp(ctx->kws[i], node->str_val)) {
-			return i + 1;
+/*
+ * Reads one operand. Returns 1 if it only opened a paren or an
+ * argument list, so another operand is still expected.
+ */
+int factor(struct parse_ctx *ctx) {
+	size_t node = ctx->pos;
+	struct expr_frame paren = { .kind = FR_PAREN };
+	struct sym_ent *se;
+	enum token type = ts_type(ctx->ts, node);
+
+	if (type == TK_LPAREN) {
+		consume(ctx, TK_LPAREN);
+		frame_vec_push(&ctx->frames, paren);
+		return 1;
+	} else if (type == TK_TEXT) {
+		consume(ctx, TK_TEXT);
+		char* name = ts_name(ctx->ts, node)->str;
+		if ((se = find_sym(ctx, name)) == NULL) {
+			ctx->err = PE_VARB4ASS;
+			ctx->err_ex = name;
+			err_abort(ctx);
+		}
+		if (ts_type(ctx->ts, ctx->pos) != TK_LPAREN) {
+			idx_vec_push(&ctx->vals, make_ast_var_node(ctx, se));
+			return 0;
 		}
+		consume(ctx, TK_LPAREN);
+		call_begin(ctx, se);
+		if (ts_type(ctx->ts, ctx->pos) != TK_RPAREN)
+			return 1;
+		call_end(ctx);
+		return 0;
+	} else if (type == TK_INT) {
+		consume(ctx, TK_INT);
+		idx_vec_push(&ctx->vals, make_ast_node(ctx, node, 0, 0));
+		return 0;
 	}
+	err_abort(ctx);
 	return 0;
 }
 
-void func_args(struct parse_ctx *ctx, struct vector *args) {
-	struct token_node *next, *next2;
-	next = vector_peek(ctx->tokens);
-	enum var_type type;
-	while (next->type != TK_RPAREN) {
-		struct ast_node *exp = expr(ctx);
-		vector_push_back(args, exp);
-		next2 = vector_peek(ctx->tokens);
-		if (next2->type == TK_COMMA) {
+uint32_t expr(struct parse_ctx *ctx) {
+	size_t base = ctx->frames.len, node;
+	struct expr_frame *top, op = { .kind = FR_OP };
+	int operand = 1, p;
+	enum token type;
+	for (;;) {
+		if (operand) {
+			operand = factor(ctx);
+			continue;
+		}
+		node = ctx->pos;
+		type = ts_type(ctx->ts, node);
+		if ((p = prec(ctx, node))) {
+			reduce(ctx, base, p);
+			consume(ctx, TK_OP);
+			op.pos = node;
+			frame_vec_push(&ctx->frames, op);
+			operand = 1;
+			continue;
+		}
+		reduce(ctx, base, 1);
+		if (ctx->frames.len == base)
+			break;
+		top = &ctx->frames.buff[ctx->frames.len - 1];
+		if (type == TK_RPAREN && top->kind == FR_PAREN) {
+			consume(ctx, TK_RPAREN);
+			ctx->frames.len--;
+		} else if (type == TK_RPAREN && top->kind == FR_CALL) {
+			top->count++;
+			call_end(ctx);
+		} else if (type == TK_COMMA && top->kind == FR_CALL) {
+			top->count++;
 			consume(ctx, TK_COMMA);
-		} else if (next2->type != TK_RPAREN) {
-			ctx->err_ex = "Expecting right parenthesis or comma";
+			operand = 1;
+		} else {
+			ctx->err = PE_CONS;
 			err_abort(ctx);
 		}
-		next = vector_peek(ctx->tokens);
 	}
-	consume(ctx, TK_RPAREN);
+	return ctx->vals.buff[--ctx->vals.len];
+}
+
+enum var_type get_type(struct parse_ctx* ctx, size_t node) {
+	if (ts_type(ctx->ts, node) != TK_TEXT)
+		return 0;
+	return ts_name(ctx->ts, node)->vtype;
+}
+
+enum keyword get_kw(struct parse_ctx* ctx, size_t node) {
+	if (ts_type(ctx->ts, node) != TK_TEXT)
+		return 0;
+	return ts_name(ctx->ts, node)->kw;
 }
 
 void func_params(struct parse_ctx *ctx, struct hashtable *params) {
-	struct token_node *next, *next2;
-	next = vector_peek(ctx->tokens);
+	size_t next, next2;
+	next = ctx->pos;
 	enum var_type type;
-	while (next->type != TK_RPAREN) {
+	while (ts_type(ctx->ts, next) != TK_RPAREN) {
 		consume(ctx, TK_TEXT);
 		type = get_type(ctx, next);
 		if (!type)
 			err_abort(ctx);
-		next2 = vector_peek(ctx->tokens);
+		next2 = ctx->pos;
 		consume(ctx, TK_TEXT);
 		consume(ctx, TK_COMMA);
-		struct sym_ent *se = calloc(1, sizeof(struct sym_ent));
+		struct sym_ent *se = arena_alloc(ctx->arena, sizeof(struct sym_ent));
 		se->type = type;
-		se->name = next2->str_val;
+		se->name = ts_name(ctx->ts, next2)->str;
 		ht_insert(params, se->name, se);
-		next = vector_peek(ctx->tokens);
+		next = ctx->pos;
 	}
 	consume(ctx, TK_RPAREN);
 }
 
-struct ast_node *func_call(struct parse_ctx *ctx, char* ident) {
-	struct ast_node *res;
-	struct sym_ent *se = get_sym(ctx, ident);
-	if (!se->func) {
-		ctx->err = PE_NOTFUNC;
-		ctx->err_ex = ident;
-		err_abort(ctx);
-	}
-	struct token_node *next = vector_peek(ctx->tokens);
-	res = make_ast_var_node(se->ret_type, ident);
-	res->type = AST_CALL;
-	vector_init(&res->many, sizeof(struct ast_node), 100);
-	while (next->type != TK_RPAREN) {
-		vector_push_back(res->many, expr(ctx));
-		next = vector_peek(ctx->tokens);
-		if (next->type == TK_COMMA)
-			consume(ctx, TK_COMMA);
-		next = vector_peek(ctx->tokens);
+uint32_t func(struct parse_ctx *ctx, struct sym_ent *se) {
+	struct ast_node res = { .type = AST_FUNC, .vtype = se->ret_type,
+		.sym = se->id };
+	uint32_t idx = ast_push(ctx, res);
+	ctx->braces = 1;
+	while (ts_type(ctx->ts, ctx->pos) != TK_RBRACE || ctx->braces > 1) {
+		if (line(ctx) != AST_NIL)
+			res.count++;
 	}
-	if (args_cmp(se->params, res->many)) {
-		ctx->err = PE_PARAMMISS;
+	// the pool may have moved while the body was parsed
+	res.end = ctx->ast->len;
+	ctx->ast->buff[idx] = res;
+	return idx;
+}
+
+/*
+ * Enters the local declared by the statement at i, if any, as a single
+ * pass would on reaching it. A clash or a nested function gives up on
+ * the split, see parse_signatures.
+ */
+void declare_local(struct parse_ctx *ctx, size_t i) {
+	enum var_type type = get_type(ctx, i);
+	char* name;
+	if (!type || ts_type(ctx->ts, i + 1) != TK_TEXT)
+		return;
+	if (ts_type(ctx->ts, i + 2) == TK_LPAREN)
 		err_abort(ctx);
-	}
-	consume(ctx, TK_RPAREN);
-	return res;
+	if (ts_type(ctx->ts, i + 2) != TK_ASS)
+		return;
+	name = ts_name(ctx->ts, i + 1)->str;
+	if (ht_find(ctx->syms, name) != NULL)
+		err_abort(ctx);
+	make_sym(ctx, type, name)->decl = i + 3;
 }
 
-struct ast_node *func(struct parse_ctx *ctx, enum var_type ret_type,
-		char* ident) {
-	struct ast_node *res;
-	struct token_node *next = vector_peek(ctx->tokens);
-	res = make_ast_var_node(ret_type, ident);
-	res->type = AST_FUNC;
-	vector_init(&res->many, sizeof(struct ast_node), 100);
-	ctx->braces = 1;
-	while (next->type != TK_RBRACE || ctx->braces > 1) {
-		vector_push_back(res->many, line(ctx));
-		next = vector_peek(ctx->tokens);
+/*
+ * Sets the body aside for later, leaving only an AST_BODY node, and
+ * skips ahead to its closing brace. Statements in a body end in
+ * semicolons, so their starts are found without parsing them.
+ */
+uint32_t defer_body(struct parse_ctx *ctx, struct sym_ent *se) {
+	struct func_body body = { .se = se, .start = ctx->pos,
+		.sym_start = ctx->symbols->len };
+	struct ast_node res = { .type = AST_BODY, .vtype = se->ret_type,
+		.sym = se->id, .count = ctx->bodies->len };
+	size_t stmt = ctx->pos;
+	enum token type;
+	for (;;) {
+		type = ts_type(ctx->ts, ctx->pos);
+		if (ctx->pos == stmt)
+			declare_local(ctx, stmt);
+		if (type == TK_NON || type == TK_LBRACE) {
+			ctx->err = PE_CONS;
+			err_abort(ctx);
+		} else if (type == TK_RBRACE) {
+			break;
+		} else if (type == TK_SEMICOL) {
+			stmt = ctx->pos + 1;
+		}
+		ctx->pos++;
 	}
-	return res;
+	body.end = ctx->pos;
+	body.sym_end = ctx->symbols->len;
+	body_vec_push(ctx->bodies, body);
+	return ast_push(ctx, res);
 }
 
-struct ast_node *line(struct parse_ctx *ctx) {
-	struct token_node *next, *next2, *next3;
-	struct ast_node *res, *var;
-	next = vector_peek(ctx->tokens);
-	res = NULL;
+uint32_t line(struct parse_ctx *ctx) {
+	size_t next, next2, next3;
+	uint32_t res;
+	next = ctx->pos;
+	res = AST_NIL;
 	int semicol = 1;
-	if (next == NULL)
-		return NULL;
+	if (ts_type(ctx->ts, next) == TK_NON)
+		return AST_NIL;
 	enum var_type type = get_type(ctx, next);
 	enum keyword kw = get_kw(ctx, next);
 	if (type) {
 		consume(ctx, TK_TEXT);
-		next2 = vector_peek(ctx->tokens);
+		next2 = ctx->pos;
 		consume(ctx, TK_TEXT);
-		next3 = vector_peek(ctx->tokens);
-		if (next3->type == TK_ASS) {
+		next3 = ctx->pos;
+		if (ts_type(ctx->ts, next3) == TK_ASS) {
 			consume(ctx, TK_ASS);
-			char* name = next2->str_val;
-			if (ht_find(ctx->syms, name)) {
+			char* name = ts_name(ctx->ts, next2)->str;
+			struct sym_ent *se;
+			if (find_sym(ctx, name)) {
 				ctx->err = PE_DUPE_VAR;
 				err_abort(ctx);
 			}
-			var = make_ast_var_node(type, name);
-			struct sym_ent *se = calloc(1, sizeof(struct sym_ent));
-			se->type = type;
-			se->name = name;
-			ht_insert(ctx->syms, name, se);
-			res = make_ast_node(next3, var, expr(ctx));
-		} else if (next3->type == TK_LPAREN) {
+			// a deferred body's locals were entered by the first pass
+			if (!ctx->shared)
+				se = make_sym(ctx, type, name);
+			else if ((se = ht_find(ctx->syms, name)) == NULL
+					|| se->decl != ctx->pos)
+				err_abort(ctx);
+			res = make_ast_node(ctx, next3, se->id, expr(ctx));
+		} else if (ts_type(ctx->ts, next3) == TK_LPAREN) {
 			consume(ctx, TK_LPAREN);
-			char* name = next2->str_val;
+			char* name = ts_name(ctx->ts, next2)->str;
 			struct sym_ent *node;
 			struct hashtable *pht;
 			int just_declared = 0;
-			if ((node = ht_find(ctx->syms, name)) == NULL) {
+			if ((node = find_sym(ctx, name)) == NULL) {
 				// make new symbol table entry
-				var = make_ast_var_node(type, name);
-				struct sym_ent *se = calloc(1, sizeof(struct sym_ent));
-				se->ret_type = type;
-				se->type = type;
-				se->name = name;
-				se->func = 1;
-				ht_init(&se->params, 10, 0.75f);
-				func_params(ctx, se->params);
-				ht_insert(ctx->syms, name, se);
-				node = ht_find(ctx->syms, name);
+				node = make_sym(ctx, type, name);
+				node->ret_type = type;
+				node->func = 1;
+				ht_init(&node->params, ctx->arena, 10, 0.75f);
+				func_params(ctx, node->params);
 				just_declared = 1;
 			} else {
 				// already declared, check params match
-				pht = calloc(1, sizeof(struct hashtable));
+				ht_init(&pht, ctx->arena, 10, 0.75f);
 				func_params(ctx, pht);
 				if (params_cmp(node->params, pht)) {
 					ctx->err = PE_PARAMMISS;
 					err_abort(ctx);
 				}
-				free(pht);
 			}
-			next3 = vector_peek(ctx->tokens);
-			if (next3->type == TK_LBRACE) {
+			if (ts_type(ctx->ts, ctx->pos) == TK_LBRACE) {
 				semicol = 0;
 				if (node != NULL && node->defined && !just_declared) {
 					ctx->err = PE_DUPE_VAR;
 					err_abort(ctx);
 				}
 				consume(ctx, TK_LBRACE);
-				res = func(ctx, type, name);
+				if (ctx->bodies)
+					res = defer_body(ctx, node);
+				else
+					res = func(ctx, node);
 				consume(ctx, TK_RBRACE);
 				ctx->braces = 0;
 			} else if (node != NULL && !just_declared) {
 				ctx->err = PE_DUPE_VAR;
 				err_abort(ctx);
 			}
-			if (res == NULL)
-				res = make_ast_skip_node();
+			if (res == AST_NIL)
+				res = make_ast_skip_node(ctx);
 		}
 	} else if (kw) {
 		if (kw == KW_RET) {
@@ -452,26 +633,380 @@ struct ast_node *line(struct parse_ctx *ctx) {
 	return res;
 }
 
-int parse(struct context *ctx) {
-	vector_reset(ctx->tokens);
-	struct token_node *node = NULL;
-	struct parse_ctx *parse_ctx = calloc(1, sizeof(struct parse_ctx));
-	parse_ctx->types_size = 1;
-	parse_ctx->types = calloc(parse_ctx->types_size, sizeof(char *));
-	parse_ctx->types[0] = "int";
-	parse_ctx->kws_size = 1;
-	parse_ctx->kws = calloc(parse_ctx->types_size, sizeof(char *));
-	parse_ctx->kws[0] = "return";
-
-	ht_init(&parse_ctx->syms, 100, 0.75f);
-	vector_init(&ctx->asts, sizeof(struct ast_node), 100);
-	parse_ctx->tokens = ctx->tokens;
-	struct ast_node *ptr;
-	do {
-		ptr = line(parse_ctx);
-		if (ptr != NULL)
-			vector_push_back(ctx->asts, ptr);
-	} while (ptr != NULL);
+void parse_begin(struct context *ctx) {
+	if (ctx->parse_arena == NULL)
+		arena_init(&ctx->parse_arena, "parse", 1 << 20);
+	struct parse_ctx *parse_ctx = arena_alloc(ctx->parse_arena,
+			sizeof(struct parse_ctx));
+	parse_ctx->arena = ctx->parse_arena;
+
+	ht_init(&parse_ctx->syms, parse_ctx->arena, 100, 0.75f);
+	sym_vec_init(&ctx->symbols, 100);
+	parse_ctx->symbols = ctx->symbols;
+	ast_pool_init(&ctx->ast, ctx->tokens->len);
+	idx_vec_init(&ctx->asts, 100);
+	parse_ctx->ast = ctx->ast;
+	parse_ctx->ts = ctx->tokens;
+	parse_ctx->pos = 0;
 	ctx->syms = parse_ctx->syms;
+	ctx->parser = parse_ctx;
+}
+
+/*
+ * Parses one top-level declaration and returns its root, or AST_NIL
+ * at the end of the input.
+ */
+uint32_t parse_next(struct context *ctx) {
+	return line(ctx->parser);
+}
+
+/*
+ * Forgets the declarations parsed so far along with their tokens.
+ * Symbols stay, later declarations may still refer to them.
+ */
+void parse_release(struct context *ctx) {
+	ctx->ast->len = 0;
+	ts_discard(ctx->tokens, ctx->parser->pos);
+}
+
+/*
+ * With a bail set, a parse error jumps there unreported. parse_fail
+ * then reports it, once the caller has done what has to come first.
+ */
+void parse_catch(struct context *ctx, jmp_buf *bail) {
+	ctx->parser->bail = bail;
+}
+
+void parse_fail(struct context *ctx) {
+	ctx->parser->bail = NULL;
+	err_abort(ctx->parser);
+}
+
+/*
+ * Like parse_release, but hands the declarations over instead of
+ * dropping them.
+ */
+struct ast_unit *parse_take(struct context *ctx) {
+	struct parse_ctx *parse_ctx = ctx->parser;
+	struct ast_unit *unit = malloc(sizeof(struct ast_unit));
+	unit->ast = ctx->ast;
+	unit->sym_count = ctx->symbols->len - parse_ctx->sym_taken;
+	unit->syms = malloc(unit->sym_count * sizeof(struct sym_ent *));
+	memcpy(unit->syms, ctx->symbols->buff + parse_ctx->sym_taken,
+			unit->sym_count * sizeof(struct sym_ent *));
+	parse_ctx->sym_taken = ctx->symbols->len;
+	ast_pool_init(&ctx->ast, 64);
+	parse_ctx->ast = ctx->ast;
+	ts_discard(ctx->tokens, parse_ctx->pos);
+	return unit;
+}
+
+void parse_end(struct context *ctx) {
+	free(ctx->parser->frames.buff);
+	free(ctx->parser->vals.buff);
+	ctx->parser = NULL;
+}
+
+int parse(struct context *ctx) {
+	uint32_t root;
+	parse_begin(ctx);
+	while ((root = parse_next(ctx)) != AST_NIL)
+		idx_vec_push(ctx->asts, root);
+	parse_end(ctx);
+	return 0;
+}
+
+/*
+ * Parses a deferred body against the table the first pass filled. It
+ * is only read here, so bodies can be parsed on several threads.
+ */
+void body_parse(struct context *ctx, struct func_body *body,
+		struct arena *arena, jmp_buf *bail) {
+	struct parse_ctx *parse_ctx = arena_alloc(arena,
+			sizeof(struct parse_ctx));
+	parse_ctx->arena = arena;
+	parse_ctx->ts = ctx->tokens;
+	parse_ctx->pos = body->start;
+	parse_ctx->syms = ctx->syms;
+	parse_ctx->symbols = ctx->symbols;
+	parse_ctx->shared = 1;
+	parse_ctx->bail = bail;
+	ast_pool_init(&body->ast, 64);
+	parse_ctx->ast = body->ast;
+	func(parse_ctx, body->se);
+	free(parse_ctx->frames.buff);
+	free(parse_ctx->vals.buff);
+}
+
+void body_job(void* arg, size_t i, int worker) {
+	struct context *ctx = arg;
+	struct func_body *body = &ctx->parser->bodies->buff[i];
+	jmp_buf bail;
+	if (setjmp(bail)) {
+		body->failed = 1;
+		return;
+	}
+	body_parse(ctx, body, ctx->job_arenas[worker], &bail);
+}
+
+/*
+ * Appends src[start, stop) to dst, moving node links along.
+ */
+void ast_copy(struct ast_pool *dst, struct ast_pool *src, uint32_t start,
+		uint32_t stop) {
+	uint32_t delta = dst->len - start;
+	struct ast_node node;
+	ast_pool_reserve(dst, dst->len + stop - start);
+	for (uint32_t i = start; i < stop; ++i) {
+		node = src->buff[i];
+		switch (node.type) {
+			case AST_OP:
+				node.left += delta;
+				node.right += delta;
+				break;
+			case AST_ASS:
+				node.right += delta;
+				break;
+			case AST_CALL:
+				node.first += delta;
+				break;
+			case AST_FUNC:
+			case AST_ARGS:
+				node.end += delta;
+				break;
+		}
+		dst->buff[dst->len++] = node;
+	}
+}
+
+/*
+ * Parses one deferred body and hands it back as a pool of its own.
+ */
+struct ast_pool *parse_body(struct context *ctx, struct func_body *body) {
+	struct ast_pool *ast;
+	body_parse(ctx, body, ctx->parse_arena, NULL);
+	ast = body->ast;
+	body->ast = NULL;
+	return ast;
+}
+
+/*
+ * Rebuilds the pool in source order with every AST_BODY replaced by
+ * the body parsed for it.
+ */
+void merge_bodies(struct context *ctx, struct body_vec *bodies) {
+	struct ast_pool *old = ctx->ast;
+	struct idx_vec *roots = ctx->asts;
+	struct func_body *body;
+	uint32_t start = 0, stop, root;
+	size_t total = old->len;
+	for (size_t i = 0; i < bodies->len; ++i)
+		if (bodies->buff[i].ast)
+			total += bodies->buff[i].ast->len;
+	ast_pool_init(&ctx->ast, total);
+	idx_vec_init(&ctx->asts, roots->len);
+	for (size_t i = 0; i < roots->len; ++i) {
+		root = roots->buff[i];
+		stop = ast_stop(old, root);
+		if (old->buff[root].type == AST_BODY) {
+			body = &bodies->buff[old->buff[root].count];
+			start = stop;
+			// left unparsed, nothing to emit
+			if (body->ast == NULL)
+				continue;
+			idx_vec_push(ctx->asts, ctx->ast->len);
+			ast_copy(ctx->ast, body->ast, 0, body->ast->len);
+		} else {
+			idx_vec_push(ctx->asts, root - start + ctx->ast->len);
+			ast_copy(ctx->ast, old, start, stop);
+			start = stop;
+		}
+	}
+	ast_pool_destroy(old);
+	idx_vec_destroy(roots);
+}
+
+/*
+ * Drops what a parse produced so the file can be parsed again.
+ */
+void parse_discard(struct context *ctx) {
+	ast_pool_destroy(ctx->ast);
+	idx_vec_destroy(ctx->asts);
+	sym_vec_destroy(ctx->symbols);
+	ctx->ast = NULL;
+	ctx->asts = NULL;
+	ctx->symbols = NULL;
+	ctx->syms = NULL;
+}
+
+/*
+ * The first pass of the split modes: the top level in order, with the
+ * bodies skipped but their locals entered. Anything it cannot split,
+ * an error included, makes it parse the file in one pass instead, so
+ * every mode accepts and reports the same programs. NULL then means
+ * the whole file is already parsed.
+ */
+struct body_vec *parse_signatures(struct context *ctx) {
+	struct body_vec *bodies;
+	jmp_buf bail;
+	uint32_t root;
+	parse_begin(ctx);
+	body_vec_init(&bodies, 64);
+	ctx->parser->bodies = bodies;
+	ctx->parser->bail = &bail;
+	if (setjmp(bail)) {
+		body_vec_destroy(bodies);
+		parse_end(ctx);
+		parse_discard(ctx);
+		parse(ctx);
+		return NULL;
+	}
+	while ((root = parse_next(ctx)) != AST_NIL)
+		idx_vec_push(ctx->asts, root);
+	ctx->parser->bail = NULL;
+	return bodies;
+}
+
+void parse_bodies_end(struct context *ctx, struct body_vec *bodies) {
+	struct func_body *body;
+	merge_bodies(ctx, bodies);
+	for (size_t i = 0; i < bodies->len; ++i) {
+		body = &bodies->buff[i];
+		if (body->ast != NULL)
+			ast_pool_destroy(body->ast);
+	}
+	body_vec_destroy(bodies);
+	parse_end(ctx);
+}
+
+/*
+ * Parses the bodies that failed again, in source order and without a
+ * bail, so the error reported is the first one a single pass would
+ * hit.
+ */
+void parse_failed(struct context *ctx, struct body_vec *bodies) {
+	for (size_t i = 0; i < bodies->len; ++i) {
+		if (!bodies->buff[i].failed)
+			continue;
+		ast_pool_destroy(bodies->buff[i].ast);
+		body_parse(ctx, &bodies->buff[i], ctx->parse_arena, NULL);
+	}
+}
+
+/*
+ * Two passes: the top level is parsed in order with function bodies
+ * skipped, so all signatures and globals are known, then the bodies are
+ * parsed on the pool and merged back in source order.
+ */
+int parse_parallel(struct context *ctx, struct thread_pool *pool) {
+	struct body_vec *bodies = parse_signatures(ctx);
+	if (bodies == NULL)
+		return 0;
+	pool_run(pool, bodies->len, body_job, ctx);
+	parse_failed(ctx, bodies);
+	parse_bodies_end(ctx, bodies);
+	return 0;
+}
+
+/*
+ * Queues the bodies of the global functions called in ast[start, stop).
+ */
+void want_calls(struct body_vec *bodies, uint32_t *body_of,
+		struct idx_vec *work, struct ast_pool *ast, uint32_t start,
+		uint32_t stop) {
+	struct ast_node *node;
+	uint32_t b;
+	for (uint32_t i = start; i < stop; ++i) {
+		node = &ast->buff[i];
+		if (node->type != AST_CALL)
+			continue;
+		b = body_of[node->sym];
+		if (b != AST_NIL && !bodies->buff[b].wanted) {
+			bodies->buff[b].wanted = 1;
+			idx_vec_push(work, b);
+		}
+	}
+}
+
+/*
+ * Queues the bodies whose pushes lie between the declaration of a name
+ * read in ast and the reader, the top level when it is NULL. out.c
+ * counts them in the name's offset, so they have to be laid out even
+ * if nothing calls them.
+ */
+void want_reads(struct body_vec *bodies, struct sym_vec *symbols,
+		struct idx_vec *work, struct ast_pool *ast,
+		struct func_body *reader) {
+	size_t pos = reader ? reader->start : SIZE_MAX, decl;
+	struct ast_node *node;
+	struct func_body *body;
+	for (uint32_t i = 0; i < ast->len; ++i) {
+		node = &ast->buff[i];
+		if (node->type != AST_VAR || (reader && node->sym >= reader->sym_start
+					&& node->sym < reader->sym_end))
+			continue;
+		decl = symbols->buff[node->sym]->decl;
+		for (size_t b = 0; b < bodies->len; ++b) {
+			body = &bodies->buff[b];
+			if (body->start >= pos)
+				break;
+			if (body->end > decl && !body->wanted) {
+				body->wanted = 1;
+				idx_vec_push(work, b);
+			}
+		}
+	}
+}
+
+/*
+ * Like parse_parallel, but only bodies reachable by calls from the
+ * entry functions and from top-level code get parsed, along with those
+ * laid out between a name they read and its declaration. The others
+ * cost the brace matching of the first pass and are left out of the
+ * output.
+ */
+int parse_lazy(struct context *ctx, char** entries, int entry_count) {
+	struct body_vec *bodies = parse_signatures(ctx);
+	struct func_body *body;
+	struct sym_ent *se;
+	struct idx_vec *work;
+	uint32_t *body_of;
+	uint32_t b;
+	jmp_buf bail;
+	if (bodies == NULL)
+		return 0;
+	body_of = malloc(ctx->symbols->len * sizeof(uint32_t));
+	for (size_t i = 0; i < ctx->symbols->len; ++i)
+		body_of[i] = AST_NIL;
+	for (size_t i = 0; i < bodies->len; ++i)
+		body_of[bodies->buff[i].se->id] = i;
+	idx_vec_init(&work, 64);
+	for (int i = 0; i < entry_count; ++i) {
+		se = ht_find(ctx->syms, intern(ctx->names, entries[i],
+					strlen(entries[i]))->str);
+		if (se == NULL || body_of[se->id] == AST_NIL
+				|| bodies->buff[body_of[se->id]].wanted)
+			continue;
+		bodies->buff[body_of[se->id]].wanted = 1;
+		idx_vec_push(work, body_of[se->id]);
+	}
+	want_calls(bodies, body_of, work, ctx->ast, 0, ctx->ast->len);
+	want_reads(bodies, ctx->symbols, work, ctx->ast, NULL);
+	while (work->len) {
+		b = work->buff[--work->len];
+		body = &bodies->buff[b];
+		// the calls parsed before an error still count, they may
+		// lead to an earlier one
+		if (setjmp(bail))
+			body->failed = 1;
+		else
+			body_parse(ctx, body, ctx->parse_arena, &bail);
+		want_calls(bodies, body_of, work, body->ast, 0, body->ast->len);
+		want_reads(bodies, ctx->symbols, work, body->ast, body);
+	}
+	parse_failed(ctx, bodies);
+	idx_vec_destroy(work);
+	free(body_of);
+	parse_bodies_end(ctx, bodies);
 	return 0;
 }
@@ -0,0 +1,96 @@
+#include "comp.h"
+
+#define BATCH_QUEUE 64
+#define UNIT_QUEUE 256
+
+/*
+ * Scanner, parser and code generator on three threads. Token batches
+ * and parsed declarations travel over single producer/single consumer
+ * queues, a NULL marks the end of each stream. Every thread keeps its
+ * own view of the names and symbols it reads; new entries ride along
+ * with the data that first refers to them.
+ */
+
+struct pipeline {
+	struct context *ctx;
+	struct scan_ctx *scanner;
+	struct spsc_queue *batches;
+	struct spsc_queue *units;
+};
+
+void* scan_thread(void* arg) {
+	struct pipeline *pl = arg;
+	struct tok_batch *batch;
+	while ((batch = scan_batch(pl->scanner)) != NULL)
+		q_push(pl->batches, batch);
+	q_push(pl->batches, NULL);
+	return NULL;
+}
+
+void* out_thread(void* arg) {
+	struct pipeline *pl = arg;
+	struct ast_unit *unit;
+	while ((unit = q_pop(pl->units)) != NULL) {
+		out_unit(pl->ctx, unit);
+		ast_pool_destroy(unit->ast);
+		free(unit->syms);
+		free(unit);
+	}
+	return NULL;
+}
+
+/*
+ * Ends both streams after a parse error: the declarations parsed
+ * before it are still emitted and written out, and the batches the
+ * scanner has left are dropped so it can finish.
+ */
+void pipeline_stop(struct pipeline *pl, pthread_t scanner,
+		pthread_t emitter) {
+	struct tok_batch *batch;
+	q_push(pl->units, NULL);
+	if (pl->ctx->tokens->feed)
+		while ((batch = q_pop(pl->batches)) != NULL)
+			batch_free(batch);
+	pthread_join(scanner, NULL);
+	pthread_join(emitter, NULL);
+	out_flush(pl->ctx);
+}
+
+int pipeline(struct context *ctx, FILE *fp) {
+	struct pipeline pl = { ctx };
+	struct intern_tab *names;
+	pthread_t scanner, emitter;
+	jmp_buf bail;
+	if (scan_open(ctx, fp) == -1)
+		return -1;
+	// the opened stream becomes the parser's window, fed by batches
+	pl.scanner = ctx->tokens->scanner;
+	q_init(&pl.batches, BATCH_QUEUE);
+	q_init(&pl.units, UNIT_QUEUE);
+	intern_init(&names, ctx->scan_arena, 1024);
+	ctx->tokens->names = names;
+	ctx->tokens->scanner = NULL;
+	ctx->tokens->feed = pl.batches;
+
+	parse_begin(ctx);
+	out_begin(ctx);
+	pthread_create(&scanner, NULL, scan_thread, &pl);
+	pthread_create(&emitter, NULL, out_thread, &pl);
+	parse_catch(ctx, &bail);
+	if (setjmp(bail)) {
+		pipeline_stop(&pl, scanner, emitter);
+		parse_fail(ctx);
+	}
+	while (parse_next(ctx) != AST_NIL)
+		q_push(pl.units, parse_take(ctx));
+	q_push(pl.units, NULL);
+	pthread_join(scanner, NULL);
+	pthread_join(emitter, NULL);
+	parse_end(ctx);
+	out_end(ctx);
+
+	intern_destroy(names);
+	q_destroy(pl.batches);
+	q_destroy(pl.units);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#include "comp.h"
+
+/*
+ * Fixed set of worker threads running one job at a time. A job is a
+ * function applied to every index below count; workers claim indices
+ * from a shared atomic counter, so uneven items balance out. The
+ * worker number is passed along for per-thread state.
+ */
+
+void* pool_worker(void* arg) {
+	struct pool_thread *self = arg;
+	struct thread_pool *pool = self->pool;
+	uint64_t seen = 0;
+	size_t i;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count)
+			pool->fn(pool->arg, i, self->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void pool_init(struct thread_pool **pool, int size) {
+	struct thread_pool *p = calloc(1, sizeof(struct thread_pool));
+	p->size = size;
+	p->threads = calloc(size, sizeof(struct pool_thread));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	for (int i = 0; i < size; ++i) {
+		p->threads[i].pool = p;
+		p->threads[i].id = i;
+		pthread_create(&p->threads[i].thread, NULL, pool_worker,
+				&p->threads[i]);
+	}
+	*pool = p;
+}
+
+void pool_run(struct thread_pool *pool, size_t count, pool_fn fn,
+		void* arg) {
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->count = count;
+	atomic_store(&pool->next, 0);
+	pool->busy = pool->size;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct thread_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->size; ++i)
+		pthread_join(pool->threads[i].thread, NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,58 @@
+#include <sched.h>
+#include "comp.h"
+
+#define Q_SPIN 64
+
+/*
+ * Bounded ring shared by exactly one producer and one consumer. Each
+ * side only writes its own index, so no locks are needed: publishing
+ * a slot is a release store of tail, freeing one a release store of
+ * head. A side that finds the ring full or empty spins briefly and
+ * then yields its core.
+ */
+
+void q_init(struct spsc_queue **q, size_t cap) {
+	struct spsc_queue *r;
+	size_t size = 2;
+	while (size < cap)
+		size *= 2;
+	r = aligned_alloc(64, sizeof(struct spsc_queue));
+	r->slots = calloc(size, sizeof(void*));
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	*q = r;
+}
+
+void q_destroy(struct spsc_queue *q) {
+	free(q->slots);
+	free(q);
+}
+
+void q_wait(int *spins) {
+	if (++*spins < Q_SPIN)
+		return;
+	*spins = 0;
+	sched_yield();
+}
+
+void q_push(struct spsc_queue *q, void* val) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	int spins = 0;
+	while (tail - atomic_load_explicit(&q->head, memory_order_acquire)
+			> q->mask)
+		q_wait(&spins);
+	q->slots[tail & q->mask] = val;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+void* q_pop(struct spsc_queue *q) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	void* val;
+	int spins = 0;
+	while (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+		q_wait(&spins);
+	val = q->slots[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return val;
+}
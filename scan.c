@@ -1,79 +1,175 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "comp.h"
 
+#define SRC_BLOCK (1 << 20)
+#define STREAM_CHUNK 4096
+
 enum scan_err { INV_CH, PAREN_MISM, PAREN_OPEN};
 
 struct scan_ctx {
-	struct vector *buff;
-	size_t size;
-	struct token_node *next;
-	struct vector *tokens;
-	enum token scan_state;
+	struct src_buf *src;
+	struct intern_tab *names;
+	const struct scan_kernel *kern;
+	struct tok_stream *tokens;
+	size_t pos;
+	int done;
 	char last_char;
 	uint64_t char_count;
 	uint64_t parens;
 	enum scan_err err_type;
-	size_t line;
 };
 
 void scan_err(struct scan_ctx* ctx) {
 	switch (ctx->err_type) {
 		case INV_CH:
-			printf("Invalid char '%c' at %lu\n",
+			fprintf(diag_stream(), "Invalid char '%c' at %lu\n",
 					ctx->last_char, ctx->char_count);
 			break;
 		case PAREN_MISM:
-			printf("Paren mismatch '%c' at %lu\n",
+			fprintf(diag_stream(), "Paren mismatch '%c' at %lu\n",
 					ctx->last_char, ctx->char_count);
 			break;
 		case PAREN_OPEN:
-			printf("%lu unclosed parenthesis\n", ctx->parens);
+			fprintf(diag_stream(), "%lu unclosed parenthesis\n", ctx->parens);
 			break;
 	}
-	exit(0);
+	compile_fail();
+}
+
+/*
+ * Maps regular files whole; anything else (pipes, ttys) is read
+ * in large blocks into one growing buffer.
+ */
+int src_load(struct src_buf **src, FILE *fp) {
+	struct src_buf *s = calloc(1, sizeof(struct src_buf));
+	struct stat st;
+	int fd = fileno(fp);
+	*src = s;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		s->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (s->data != MAP_FAILED) {
+			s->size = st.st_size;
+			s->mapped = 1;
+			return 0;
+		}
+		s->data = NULL;
+	}
+	size_t cap = 0;
+	ssize_t n;
+	do {
+		if (s->size == cap) {
+			cap += SRC_BLOCK;
+			s->data = realloc(s->data, cap);
+		}
+		n = read(fd, s->data + s->size, cap - s->size);
+		if (n > 0)
+			s->size += n;
+	} while (n > 0);
+	return n < 0 ? -1 : 0;
+}
+
+void src_release(struct src_buf *src) {
+	if (src->mapped)
+		munmap(src->data, src->size);
+	else
+		free(src->data);
+	free(src);
+}
+
+/*
+ * Lets the kernel reclaim mapped pages the scanner is done with. They
+ * fault back in from the file if an error message needs a line number.
+ */
+void src_drop(struct src_buf *src, size_t upto) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	upto &= ~(page - 1);
+	if (!src->mapped || upto <= src->dropped)
+		return;
+	madvise(src->data + src->dropped, upto - src->dropped, MADV_DONTNEED);
+	src->dropped = upto;
+}
+
+void ts_init(struct tok_stream **ts, struct intern_tab *names,
+		struct src_buf *src, size_t cap) {
+	struct tok_stream *t = calloc(1, sizeof(struct tok_stream));
+	t->names = names;
+	t->src = src;
+	ts_reserve(t, cap < 16 ? 16 : cap);
+	t->kind[0] = TK_NON;
+	t->off[0] = 0;
+	*ts = t;
+}
+
+void ts_reserve(struct tok_stream *ts, size_t cap) {
+	if (cap <= ts->cap)
+		return;
+	ts->kind = realloc(ts->kind, cap * sizeof(uint8_t));
+	ts->val = realloc(ts->val, cap * sizeof(uint32_t));
+	ts->off = realloc(ts->off, cap * sizeof(uint32_t));
+	ts->cap = cap;
+}
+
+void ts_destroy(struct tok_stream *ts) {
+	free(ts->kind);
+	free(ts->val);
+	free(ts->off);
+	free(ts);
+}
+
+size_t ts_line(struct tok_stream *ts, size_t i) {
+	const char* p = ts->src->data;
+	const char* end = p + ts->off[ts_at(ts, i)];
+	size_t line = 1;
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		line++;
+		p++;
+	}
+	return line;
 }
 
-void print_token(struct token_node *t) {
+void print_token(struct tok_stream *ts, size_t i) {
 	char* str = calloc(1000, sizeof(char));
-	token_str(t, str);
+	token_str(ts, i, str);
 	printf("%s", str);
 	free(str);
 }
 
-void token_str(struct token_node *t, char* str) {
-	if (t->type == TK_INT) {
-		sprintf(str, "%d", t->int_val);
-	} else if (t->type == TK_TEXT) {
-		sprintf(str, "%s", t->str_val);
+void token_str(struct tok_stream *ts, size_t i, char* str) {
+	if (ts_type(ts, i) == TK_INT) {
+		sprintf(str, "%d", ts_int(ts, i));
+	} else if (ts_type(ts, i) == TK_TEXT) {
+		sprintf(str, "%s", ts_name(ts, i)->str);
 	} else {
-		sprintf(str, "%c", t->char_val);
+		sprintf(str, "%c", ts_char(ts, i));
 	}
 }
 
-void print_tokens(struct vector *tokens) {
-	vector_reset(tokens);
-	struct token_node *t = NULL;
-	int start = 1;
-	while ((t = vector_next(tokens)) != NULL) {
-		if (start) {
-			start = 0;
-		} else {
+void print_tokens(struct tok_stream *ts) {
+	for (size_t i = ts->base; i < ts->base + ts->len; ++i) {
+		if (i > ts->base)
 			printf(", ");
-		}
-		print_token(t);
+		print_token(ts, i);
 	}
 	puts("");
 }
 
-void commit_token(struct scan_ctx *scan_ctx) {
-	int len = scan_ctx->buff->len;
-	scan_ctx->buff->len = 0;
-	char* val;
-	switch (scan_ctx->scan_state) {
+int scan_int(const char* p, size_t len) {
+	unsigned int val = 0;
+	for (size_t i = 0; i < len && p[i] >= '0' && p[i] <= '9'; ++i)
+		val = val * 10 + (p[i] - '0');
+	return (int)val;
+}
+
+void commit_token(struct scan_ctx *scan_ctx, enum token type,
+		size_t start, size_t end) {
+	uint32_t val;
+	const char* p = scan_ctx->src->data + start;
+	switch (type) {
 		case TK_INT:
-			val = calloc(len, sizeof(char));
-			memcpy(val, scan_ctx->buff->buff, len);
-			scan_ctx->next->int_val = atoi(val);
-			free(val);
+			val = scan_int(p, end - start);
 			break;
 		case TK_LPAREN:
 		case TK_RPAREN:
@@ -82,91 +178,181 @@ void commit_token(struct scan_ctx *scan_ctx) {
 		case TK_OP:
 		case TK_SEMICOL:
 		case TK_ASS:
-			scan_ctx->next->char_val = ((char *)scan_ctx->buff->buff)[0];	
+			val = p[0];
 			break;
 		case TK_TEXT:
-			val = calloc(len + 1, sizeof(char));
-			memcpy(val, scan_ctx->buff->buff, len);
-			scan_ctx->next->str_val = val;
-			scan_ctx->next->str_size = len;
+			val = intern(scan_ctx->names, p, end - start)
+				- scan_ctx->names->ents;
 			break;
 		case TK_NON:
 		default:
 			return;
 	}
-	scan_ctx->next->type = scan_ctx->scan_state;
-	scan_ctx->next->line = scan_ctx->line;
-	vector_push_back(scan_ctx->tokens, scan_ctx->next);
-	scan_ctx->next = calloc(1, sizeof(struct token_node));
+	ts_push(scan_ctx->tokens, type, val, start);
 }
 
-void handle_single(struct scan_ctx* scan_ctx, char c) {
-	if (scan_ctx->scan_state != TK_NON) {
-		commit_token(scan_ctx);
-	}
+void handle_single(struct scan_ctx* scan_ctx, char c, size_t pos) {
+	enum token type;
 	if (c == '+' || c == '-' || c == '*' || c == '/') {
-		scan_ctx->scan_state = TK_OP;
-		vector_push_back(scan_ctx->buff, &c);
-	} else if (c == ';' || c == '(' || c == ')' || c == '='
-				|| c == ',' || c == '}' || c == '{') {
-		scan_ctx->scan_state = (enum token)c;
+		type = TK_OP;
+	} else {
+		type = (enum token)c;
 		if (c == '(')
 			scan_ctx->parens++;
 		else if (c == ')' && scan_ctx->parens-- == 0) {
 			scan_ctx->err_type = PAREN_MISM;
 			scan_err(scan_ctx);
 		}
-		vector_push_back(scan_ctx->buff, &c);
-	} else {
-		if (c == '\n')
-			scan_ctx->line++;
-		scan_ctx->scan_state = TK_NON;
 	}
+	commit_token(scan_ctx, type, pos, pos + 1);
 }
 
-int scan(struct context *ctx, FILE *fp) {
+/*
+ * Identifier, number and blank runs are measured in bulk by the
+ * selected kernel; only punctuation is handled a byte at a time.
+ * Stops once the stream holds limit tokens or the input ends.
+ */
+void scan_chunk(struct scan_ctx *scan_ctx, size_t limit) {
 	char c;
-	struct scan_ctx* scan_ctx = calloc(1, sizeof(struct scan_ctx));
-	scan_ctx->next = calloc(1, sizeof(struct token_node));
-	scan_ctx->line = 1;
-	vector_init(&scan_ctx->tokens, sizeof(struct token_node), 100);
-	vector_init(&scan_ctx->buff, sizeof(char), 100);
-	scan_ctx->scan_state = TK_NON;
-
-	while ((c = getc(fp)) != EOF) {
+	const struct scan_kernel *kern = scan_ctx->kern;
+	const char* data = scan_ctx->src->data;
+	size_t size = scan_ctx->src->size;
+	size_t pos = scan_ctx->pos, end;
+	while (pos < size && scan_ctx->tokens->len < limit) {
+		c = data[pos];
 		scan_ctx->last_char = c;
-		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
-			if (scan_ctx->scan_state != TK_TEXT) {
-				commit_token(scan_ctx);
-			}
-			scan_ctx->scan_state = TK_TEXT;
-			vector_push_back(scan_ctx->buff, &c);
-		} else if (c >= '0' && c <= '9') {
-			if (!(scan_ctx->scan_state & (TK_INT | TK_TEXT))) {
-				commit_token(scan_ctx);
-			}
-			if (scan_ctx->scan_state != TK_TEXT) {
-				scan_ctx->scan_state = TK_INT;
-			}
-			vector_push_back(scan_ctx->buff, &c);
-		} else {
-			handle_single(scan_ctx, c);
-		} 
+		switch (scan_class[(uint8_t)c]) {
+			case CL_ALPHA:
+				end = kern->ident_end(data, pos + 1, size);
+				commit_token(scan_ctx, TK_TEXT, pos, end);
+				break;
+			case CL_DIGIT:
+				end = kern->digit_end(data, pos + 1, size);
+				commit_token(scan_ctx, TK_INT, pos, end);
+				break;
+			case CL_PUNCT:
+				handle_single(scan_ctx, c, pos);
+				end = pos + 1;
+				break;
+			default:
+				end = kern->blank_end(data, pos, size);
+				break;
+		}
+		pos = end;
 	}
+	scan_ctx->pos = pos;
+	if (pos < size)
+		return;
+	scan_ctx->tokens->scanner = NULL;
+	scan_ctx->done = 1;
 	scan_ctx->char_count++;
-	if (scan_ctx->scan_state != TK_NON) {
-		commit_token(scan_ctx);
-		free(scan_ctx->next);
-	}
 	if (scan_ctx->parens > 0) {
 		scan_ctx->err_type = PAREN_OPEN;
 		scan_err(scan_ctx);
 	}
-#ifdef SCAN_DBG
-	print_tokens(scan_ctx->tokens);
-#endif
+}
+
+/*
+ * Scans the next chunk into a stream of its own, for a reader on
+ * another thread. NULL once the input is exhausted.
+ */
+struct tok_batch *scan_batch(struct scan_ctx *scan_ctx) {
+	struct tok_batch *batch;
+	size_t names = scan_ctx->names->count;
+	if (scan_ctx->done)
+		return NULL;
+	batch = calloc(1, sizeof(struct tok_batch));
+	ts_init(&batch->tokens, scan_ctx->names, scan_ctx->src, STREAM_CHUNK + 1);
+	batch->tokens->scanner = scan_ctx;
+	scan_ctx->tokens = batch->tokens;
+	scan_chunk(scan_ctx, STREAM_CHUNK);
+	batch->name_count = scan_ctx->names->count - names;
+	batch->names = malloc(batch->name_count * sizeof(struct intern_ent));
+	memcpy(batch->names, scan_ctx->names->ents + names,
+			batch->name_count * sizeof(struct intern_ent));
+	return batch;
+}
+
+void batch_free(struct tok_batch *batch) {
+	ts_destroy(batch->tokens);
+	free(batch->names);
+	free(batch);
+}
+
+void ts_append(struct tok_stream *ts, struct tok_batch *batch) {
+	struct tok_stream *b = batch->tokens;
+	if (ts->len + b->len + 1 > ts->cap)
+		ts_reserve(ts, ts->len + b->len + 1 > ts->cap * 2
+				? ts->len + b->len + 1 : ts->cap * 2);
+	memcpy(ts->kind + ts->len, b->kind, b->len + 1);
+	memcpy(ts->val + ts->len, b->val, b->len * sizeof(uint32_t));
+	memcpy(ts->off + ts->len, b->off, (b->len + 1) * sizeof(uint32_t));
+	ts->len += b->len;
+	intern_adopt(ts->names, batch->names, batch->name_count);
+}
+
+void ts_fill(struct tok_stream *ts, size_t i) {
+	struct tok_batch *batch;
+	while (i - ts->base >= ts->len && ts->scanner)
+		scan_chunk(ts->scanner, ts->len + STREAM_CHUNK);
+	while (i - ts->base >= ts->len && ts->feed) {
+		if ((batch = q_pop(ts->feed)) == NULL) {
+			ts->feed = NULL;
+			break;
+		}
+		ts_append(ts, batch);
+		batch_free(batch);
+	}
+}
+
+/*
+ * Drops every token before upto. Whatever was already scanned past it
+ * moves to the front of the arrays.
+ */
+void ts_discard(struct tok_stream *ts, size_t upto) {
+	size_t n = upto - ts->base, keep = ts->len - n;
+	if (n == 0)
+		return;
+	memmove(ts->kind, ts->kind + n, keep + 1);
+	memmove(ts->val, ts->val + n, keep * sizeof(uint32_t));
+	memmove(ts->off, ts->off + n, (keep + 1) * sizeof(uint32_t));
+	ts->base = upto;
+	ts->len = keep;
+	src_drop(ts->src, ts->off[0]);
+}
+
+/*
+ * Sets up the scanner without reading any tokens; they are produced
+ * as the parser asks for them.
+ */
+int scan_open(struct context *ctx, FILE *fp) {
+	if (ctx->scan_arena == NULL)
+		arena_init(&ctx->scan_arena, "scan", 1 << 20);
+	struct scan_ctx* scan_ctx = arena_alloc(ctx->scan_arena,
+			sizeof(struct scan_ctx));
+	if (src_load(&scan_ctx->src, fp) == -1
+			|| scan_ctx->src->size > UINT32_MAX) {
+		fprintf(diag_stream(), "SCAN ERROR\n");
+		return -1;
+	}
+	scan_ctx->kern = scan_kernel_select();
+	intern_init(&scan_ctx->names, ctx->scan_arena, 1024);
+	ts_init(&scan_ctx->tokens, scan_ctx->names, scan_ctx->src,
+			STREAM_CHUNK * 2);
+	scan_ctx->tokens->scanner = scan_ctx;
+	ctx->src = scan_ctx->src;
+	ctx->names = scan_ctx->names;
 	ctx->tokens = scan_ctx->tokens;
 	return 0;
 }
 
-
+int scan(struct context *ctx, FILE *fp) {
+	if (scan_open(ctx, fp) == -1)
+		return -1;
+	ts_reserve(ctx->tokens, ctx->src->size / 4 + 16);
+	scan_chunk(ctx->tokens->scanner, SIZE_MAX);
+#ifdef SCAN_DBG
+	print_tokens(ctx->tokens);
+#endif
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include "comp.h"
+
+#if defined(__x86_64__) && !defined(SCAN_NO_SIMD)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Run finders for the scanner. Each returns the first offset at or
+ * after pos that is not part of the run.
+ */
+
+const uint8_t scan_class[256] = {
+	['a' ... 'z'] = CL_ALPHA,
+	['A' ... 'Z'] = CL_ALPHA,
+	['0' ... '9'] = CL_DIGIT,
+	['+'] = CL_PUNCT, ['-'] = CL_PUNCT, ['*'] = CL_PUNCT,
+	['/'] = CL_PUNCT, [';'] = CL_PUNCT, ['('] = CL_PUNCT,
+	[')'] = CL_PUNCT, ['='] = CL_PUNCT, [','] = CL_PUNCT,
+	['{'] = CL_PUNCT, ['}'] = CL_PUNCT,
+};
+
+size_t scalar_ident_end(const char* p, size_t pos, size_t size) {
+	while (pos < size && scan_class[(uint8_t)p[pos]] & (CL_ALPHA | CL_DIGIT))
+		pos++;
+	return pos;
+}
+
+size_t scalar_digit_end(const char* p, size_t pos, size_t size) {
+	while (pos < size && scan_class[(uint8_t)p[pos]] & CL_DIGIT)
+		pos++;
+	return pos;
+}
+
+size_t scalar_blank_end(const char* p, size_t pos, size_t size) {
+	while (pos < size && !scan_class[(uint8_t)p[pos]])
+		pos++;
+	return pos;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Range checks use the signed-compare trick: shifting the range start
+ * to -128 turns "lo <= c <= hi" into one signed less-than.
+ */
+#define SSE_RANGE(v, lo, n) _mm_cmplt_epi8(_mm_add_epi8(v, \
+		_mm_set1_epi8((char)(0x80 - (lo)))), _mm_set1_epi8((char)(0x80 + (n))))
+#define AVX_RANGE(v, lo, n) _mm256_cmpgt_epi8(_mm256_set1_epi8( \
+		(char)(0x80 + (n))), _mm256_add_epi8(v, \
+		_mm256_set1_epi8((char)(0x80 - (lo)))))
+
+static inline __m128i sse_alpha(__m128i v) {
+	return SSE_RANGE(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26);
+}
+
+static inline __m128i sse_digit(__m128i v) {
+	return SSE_RANGE(v, '0', 10);
+}
+
+static inline __m128i sse_punct(__m128i v) {
+	// '(' ... '/' minus '.' covers ( ) * + , - /
+	__m128i m = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+			SSE_RANGE(v, '(', 8));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+	return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+}
+
+size_t sse2_ident_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 16 <= size; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + pos));
+		uint32_t m = _mm_movemask_epi8(_mm_or_si128(sse_alpha(v),
+				sse_digit(v))) ^ 0xFFFF;
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return scalar_ident_end(p, pos, size);
+}
+
+size_t sse2_digit_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 16 <= size; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + pos));
+		uint32_t m = _mm_movemask_epi8(sse_digit(v)) ^ 0xFFFF;
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return scalar_digit_end(p, pos, size);
+}
+
+size_t sse2_blank_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 16 <= size; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + pos));
+		uint32_t tok = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+				sse_alpha(v), sse_digit(v)), sse_punct(v)));
+		if (tok)
+			return pos + __builtin_ctz(tok);
+	}
+	return scalar_blank_end(p, pos, size);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx_alpha(__m256i v) {
+	return AVX_RANGE(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx_digit(__m256i v) {
+	return AVX_RANGE(v, '0', 10);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx_punct(__m256i v) {
+	__m256i m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v,
+			_mm256_set1_epi8('.')), AVX_RANGE(v, '(', 8));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+	return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+}
+
+__attribute__((target("avx2")))
+size_t avx2_ident_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 32 <= size; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + pos));
+		uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+				avx_alpha(v), avx_digit(v)));
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return sse2_ident_end(p, pos, size);
+}
+
+__attribute__((target("avx2")))
+size_t avx2_digit_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 32 <= size; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + pos));
+		uint32_t m = ~(uint32_t)_mm256_movemask_epi8(avx_digit(v));
+		if (m)
+			return pos + __builtin_ctz(m);
+	}
+	return sse2_digit_end(p, pos, size);
+}
+
+__attribute__((target("avx2")))
+size_t avx2_blank_end(const char* p, size_t pos, size_t size) {
+	for (; pos + 32 <= size; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + pos));
+		uint32_t tok = _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(avx_alpha(v), avx_digit(v)), avx_punct(v)));
+		if (tok)
+			return pos + __builtin_ctz(tok);
+	}
+	return sse2_blank_end(p, pos, size);
+}
+
+#endif
+
+const struct scan_kernel scan_kernels[] = {
+	{ "scalar", scalar_ident_end, scalar_digit_end, scalar_blank_end },
+#ifdef SCAN_X86
+	{ "sse2", sse2_ident_end, sse2_digit_end, sse2_blank_end },
+	{ "avx2", avx2_ident_end, avx2_digit_end, avx2_blank_end },
+#endif
+};
+
+const struct scan_kernel *scan_kernel_select() {
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &scan_kernels[2];
+	return &scan_kernels[1];
+#else
+	return &scan_kernels[0];
+#endif
+}
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "comp.h"
+
+#define REQ_MAX (1 << 16)
+#define COPY_BLOCK (1 << 16)
+
+/*
+ * Compile server on a Unix socket. A request is the client's command
+ * line, a 32-bit length followed by NUL separated arguments, and for
+ * the input "-" the source text after it. The reply is exactly what
+ * the compiler would have printed to stdout. Requests run one at a
+ * time in a single context whose arenas stay warm between them.
+ */
+
+int copy_fd(int to, int from) {
+	char buf[COPY_BLOCK];
+	ssize_t n;
+	while ((n = read(from, buf, sizeof(buf))) > 0)
+		if (write_full(to, buf, n) == -1)
+			return -1;
+	return n < 0 ? -1 : 0;
+}
+
+/*
+ * Splits the argument block into argv, with a stand-in for argv[0].
+ * Returns argc, or -1 on a short or oversized request.
+ */
+int read_request(int fd, char* buf, char** argv) {
+	uint32_t len;
+	int argc = 1;
+	if (read_full(fd, &len, sizeof(len)) == -1 || len >= REQ_MAX)
+		return -1;
+	if (read_full(fd, buf, len) == -1)
+		return -1;
+	buf[len] = '\0';
+	argv[0] = "compiler";
+	for (size_t i = 0; i < len; i += strlen(buf + i) + 1)
+		argv[argc++] = buf + i;
+	return argc;
+}
+
+/*
+ * Code run with --run could take the server down with it, so it runs
+ * in a child. The child reports to the client itself.
+ */
+void serve_run(struct context *ctx, FILE *fp, struct options *opt) {
+	FILE* diag = diag_stream();
+	int status;
+	pid_t pid;
+	fflush(diag);
+	if ((pid = fork()) == 0) {
+		jit_run(ctx, fp, opt);
+		fflush(diag);
+		_exit(0);
+	}
+	if (pid == -1 || waitpid(pid, &status, 0) == -1)
+		fprintf(diag, "cannot run program\n");
+	else if (WIFSIGNALED(status))
+		fprintf(diag, "Program killed by signal %d\n", WTERMSIG(status));
+}
+
+/*
+ * Threaded modes are compiled sequentially, since an error on a worker
+ * thread has no job to unwind to. The modes that do more than print
+ * assembly report to the client through the request's job.
+ */
+void serve_compile(struct context *ctx, FILE *fp, struct options *opt) {
+	opt->jobs = 0;
+	opt->piped = 0;
+	if (opt->interp)
+		interp(ctx, fp, opt);
+	else if (opt->run)
+		serve_run(ctx, fp, opt);
+	else if (opt->assemble || opt->link)
+		build(ctx, fp, opt);
+	else
+		compile(ctx, fp, opt);
+}
+
+/*
+ * Runs one request. Returns 1 when the client asked the server to
+ * stop.
+ */
+int serve_request(struct context *ctx, int fd) {
+	struct options opt = { 0 };
+	struct compile_job job;
+	char* buf = malloc(REQ_MAX);
+	char** argv = malloc((REQ_MAX + 1) * sizeof(char*));
+	int argc = read_request(fd, buf, argv);
+	int quit = 0;
+	FILE* fp = NULL;
+	FILE* out;
+	job.diag = fdopen(fd, "w");
+	out = job.diag;
+	if (argc > 1 && !strcmp(argv[1], "--shutdown"))
+		quit = 1;
+	else if (argc < 0 || parse_options(&opt, argc, argv) == -1 || opt.batch)
+		fprintf(job.diag, "bad request\n");
+	// -c and --link write their output themselves
+	else if (opt.output && !opt.assemble && !opt.link
+			&& (out = fopen(opt.output, "w")) == NULL) {
+		fprintf(job.diag, "cannot write %s\n", opt.output);
+		out = job.diag;
+	} else if (opt.path != NULL) {
+		if (!strcmp(opt.path, "-"))
+			fp = fdopen(dup(fd), "r");
+		else
+			fp = fopen(opt.path, "r");
+	}
+	ctx->out = out;
+	if (fp != NULL) {
+		double start = wall_time();
+		cur_job = &job;
+		if (setjmp(job.bail) == 0)
+			serve_compile(ctx, fp, &opt);
+		cur_job = NULL;
+		if (opt.stats)
+			report_stats(ctx, wall_time() - start);
+		fclose(fp);
+	}
+	if (ctx->parser)
+		parse_end(ctx);
+	if (ctx->emitter)
+		out_abort(ctx);
+	if (out != job.diag)
+		fclose(out);
+	context_reset(ctx);
+	fclose(job.diag);
+	options_release(&opt);
+	free(argv);
+	free(buf);
+	return quit;
+}
+
+int serve(char* sock_path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct context *ctx;
+	struct stat st;
+	int lfd, fd;
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", sock_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, sock_path);
+	// a socket left behind by an earlier server is replaced
+	if (stat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(sock_path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| listen(lfd, 16) == -1) {
+		perror(sock_path);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	ctx = calloc(1, sizeof(struct context));
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (serve_request(ctx, fd))
+			break;
+	}
+	close(lfd);
+	unlink(sock_path);
+	context_release(ctx);
+	return 0;
+}
+
+int req_add(char* buf, uint32_t *len, char* arg) {
+	if (*len + strlen(arg) + 1 >= REQ_MAX) {
+		fprintf(stderr, "command line too long\n");
+		return -1;
+	}
+	strcpy(buf + *len, arg);
+	*len += strlen(arg) + 1;
+	return 0;
+}
+
+// the output may not exist yet, so it is put under the working directory
+char* out_path(char* path, char* resolved) {
+	if (path[0] == '/' || getcwd(resolved, PATH_MAX) == NULL)
+		return path;
+	strncat(resolved, "/", PATH_MAX - strlen(resolved) - 1);
+	strncat(resolved, path, PATH_MAX - strlen(resolved) - 1);
+	return resolved;
+}
+
+/*
+ * Client side: the rest of the command line goes to the server with
+ * the input and output made absolute, the reply is copied to stdout.
+ * -c and --link get their default output named here, so it lands in
+ * the client's directory rather than the server's.
+ */
+int connect_server(char* sock_path, int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct options opt = { 0 };
+	char resolved[PATH_MAX];
+	char* buf = malloc(REQ_MAX);
+	char* obj;
+	uint32_t len = 0;
+	int fd, res = 0;
+	parse_options(&opt, argc, argv);
+	for (int i = 1; i < argc; ++i) {
+		char* arg = argv[i];
+		if (arg == opt.path && strcmp(arg, "-")
+				&& realpath(arg, resolved) != NULL)
+			arg = resolved;
+		if (arg == opt.output)
+			arg = out_path(arg, resolved);
+		if (req_add(buf, &len, arg) == -1) {
+			res = 1;
+			goto done;
+		}
+	}
+	if ((opt.assemble || opt.link) && opt.output == NULL && opt.path) {
+		obj = opt.link ? strdup("a.out") : object_name(opt.path);
+		res = req_add(buf, &len, "-o") == -1
+			|| req_add(buf, &len, out_path(obj, resolved)) == -1;
+		free(obj);
+		if (res)
+			goto done;
+	}
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(sock_path);
+		res = 1;
+		goto done;
+	}
+	if (write_full(fd, &len, sizeof(len)) == -1
+			|| write_full(fd, buf, len) == -1
+			|| (opt.path && !strcmp(opt.path, "-") && copy_fd(fd, 0) == -1))
+		res = 1;
+	shutdown(fd, SHUT_WR);
+	if (copy_fd(1, fd) == -1)
+		res = 1;
+	close(fd);
+done:
+	options_release(&opt);
+	free(buf);
+	return res;
+}
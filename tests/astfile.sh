@@ -0,0 +1,64 @@
+#!/bin/sh
+# --from-ast must refuse a file whose nodes point at themselves or at
+# nodes after them. Each operand index of an emitted program is
+# overwritten in turn with the index of its own node, and every such
+# file has to be rejected before code generation.
+#
+#   tests/astfile.sh [compiler]
+
+cc=${1:-./build/compiler}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# sizes of struct ast_hdr and struct ast_node
+HDR=32
+NODE=16
+
+u32() {
+	od -An -tu4 -j"$2" -N4 "$1" | tr -d ' '
+}
+
+# writes $3 as a 32-bit little-endian value at offset $2 of file $1
+put32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($3 & 255)) \
+		$(($3 >> 8 & 255)) $(($3 >> 16 & 255)) $(($3 >> 24 & 255)))" \
+		| dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+printf 'int g(){return 2;}\nint main(){int a=g()+1;return a;}\n' \
+	> "$tmp/in.c"
+"$cc" --emit-ast "$tmp/ast" "$tmp/in.c" > /dev/null 2>&1
+if ! "$cc" --from-ast "$tmp/ast" > "$tmp/out" 2>&1 \
+		|| grep -q 'Bad AST file' "$tmp/out"; then
+	echo "intact file refused"; cat "$tmp/out"; fail=1
+fi
+
+nodes=$(u32 "$tmp/ast" 8)
+i=0
+checked=0
+while [ "$i" -lt "$nodes" ]; do
+	at=$((HDR + NODE * i))
+	# left and right of AST_OP, right of AST_ASS, first of AST_CALL
+	case $(od -An -tu1 -j"$at" -N1 "$tmp/ast" | tr -d ' ') in
+	0) fields="4 8" ;;
+	2|5) fields=8 ;;
+	*) fields= ;;
+	esac
+	for f in $fields; do
+		cp "$tmp/ast" "$tmp/bad"
+		put32 "$tmp/bad" $((at + f)) "$i"
+		"$cc" --from-ast "$tmp/bad" > "$tmp/out" 2>&1
+		if ! grep -q 'Bad AST file (index out of range)' "$tmp/out"; then
+			echo "node $i: index at +$f pointing at itself accepted"
+			fail=1
+		fi
+		checked=$((checked + 1))
+	done
+	i=$((i + 1))
+done
+if [ "$checked" -lt 4 ]; then
+	echo "only $checked indices found to corrupt"; fail=1
+fi
+[ $fail = 0 ] && echo "astfile OK"
+exit $fail
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Objects from --integrated-as must match what as makes of the same
+# assembly: the same code and relocations, the same symbols. Every
+# compiling test program is built both ways and the objdump -dr,
+# readelf -s and readelf -r listings are diffed.
+#
+#   tests/elf.sh [compiler]
+
+cc=${1:-./build/compiler}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# file offsets depend on how the object is laid out, not its contents
+listings() {
+	objdump -dr "$1" | sed 1,3d
+	readelf -sW "$1"
+	readelf -rW "$1" | sed 's/ at offset 0x[0-9a-f]*//'
+}
+
+for f in "$dir"/elf/*.c "$dir"/scope/ok_*.c; do
+	name=$(basename "$f" .c)
+	if ! "$cc" -c "$f" -o "$tmp/as.o" > "$tmp/log" 2>&1 \
+			|| ! "$cc" -c --integrated-as "$f" -o "$tmp/ia.o" \
+			>> "$tmp/log" 2>&1 || [ -s "$tmp/log" ]; then
+		echo "$name: build failed"; cat "$tmp/log"; fail=1
+		continue
+	fi
+	listings "$tmp/as.o" > "$tmp/as.txt"
+	listings "$tmp/ia.o" > "$tmp/ia.txt"
+	if ! diff "$tmp/as.txt" "$tmp/ia.txt" > "$tmp/diff"; then
+		echo "$name: objects differ"; head -20 "$tmp/diff"; fail=1
+	fi
+done
+[ $fail = 0 ] && echo "elf OK"
+exit $fail
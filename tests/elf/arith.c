@@ -0,0 +1,5 @@
+int big = 2147483647;
+int neg = 0 - 2147483647;
+int div(){int a=big/7;int b=neg/3;return a-b*2;}
+int mix(){int x=3+4*(2-1);int y=(x*x-x)/(x+1);return (y-x)*(y+x)/2;}
+int main(){int r=mix()+div();return r;}
@@ -0,0 +1,45 @@
+int wide(){
+	int v0 = 1;
+	int v1 = v0 + 1;
+	int v2 = v1 + 2;
+	int v3 = v2 + 3;
+	int v4 = v3 + 4;
+	int v5 = v4 + 5;
+	int v6 = v5 + 6;
+	int v7 = v6 + 7;
+	int v8 = v7 + 8;
+	int v9 = v8 + 9;
+	int v10 = v9 + 10;
+	int v11 = v10 + 11;
+	int v12 = v11 + 12;
+	int v13 = v12 + 13;
+	int v14 = v13 + 14;
+	int v15 = v14 + 15;
+	int v16 = v15 + 16;
+	int v17 = v16 + 17;
+	int v18 = v17 + 18;
+	int v19 = v18 + 19;
+	int v20 = v19 + 20;
+	int v21 = v20 + 21;
+	int v22 = v21 + 22;
+	int v23 = v22 + 23;
+	int v24 = v23 + 24;
+	int v25 = v24 + 25;
+	int v26 = v25 + 26;
+	int v27 = v26 + 27;
+	int v28 = v27 + 28;
+	int v29 = v28 + 29;
+	int v30 = v29 + 30;
+	int v31 = v30 + 31;
+	int v32 = v31 + 32;
+	int v33 = v32 + 33;
+	int v34 = v33 + 34;
+	int v35 = v34 + 35;
+	int v36 = v35 + 36;
+	int v37 = v36 + 37;
+	int v38 = v37 + 38;
+	int v39 = v38 + 39;
+	return v0 * v39 + v20;
+}
+int deep(){int a=wide();int b=wide()*wide();return b-a;}
+int main(){int r=deep();return r;}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# --interp must print what --run prints, whichever front end built the
+# AST. Every program in interp/ and a few generated ones, started from
+# functions at different depths, are run both ways and compared.
+#
+#   tests/interp.sh [compiler]
+
+cc=${1:-./build/compiler}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# name, then the arguments both modes get
+check() {
+	name=$1; shift
+	for mode in "" "--jobs 2" --lazy --stream ast; do
+		if [ "$mode" = ast ]; then
+			"$cc" --emit-ast "$tmp/ast" "$@" > /dev/null 2>&1
+			"$cc" --run --from-ast "$tmp/ast" "$@" > "$tmp/want" 2>&1
+			"$cc" --interp --from-ast "$tmp/ast" "$@" > "$tmp/got" 2>&1
+		else
+			"$cc" --run $mode "$@" > "$tmp/want" 2>&1
+			"$cc" --interp $mode "$@" > "$tmp/got" 2>&1
+		fi
+		if [ ! -s "$tmp/want" ] || ! cmp -s "$tmp/want" "$tmp/got"; then
+			echo "$name: ${mode:-sequential} differs"
+			echo "  --run:    $(head -1 "$tmp/want")"
+			echo "  --interp: $(head -1 "$tmp/got")"
+			fail=1
+		fi
+	done
+}
+
+for f in "$dir"/interp/*.c; do
+	check "$(basename "$f" .c)" "$f"
+done
+
+${CC:-cc} -O2 "$dir/../bench/gen.c" -o "$tmp/gen" || exit 1
+"$tmp/gen" 30 5 > "$tmp/gen.c"
+for fn in fn0 fn3 fn9 fn15 fn29; do
+	check "gen $fn" --entry "$fn" "$tmp/gen.c"
+done
+[ $fail = 0 ] && echo "interp OK"
+exit $fail
@@ -0,0 +1,3 @@
+int ops(){int a=7;int b=0-3;int c=a*b-a/b+(a-b)*(a+b);return c/2;}
+int big(){int m=2147483647;int n=m*m*m;return n/1000003;}
+int main(){int r=ops()*big();return r-ops();}
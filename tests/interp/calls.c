@@ -0,0 +1,5 @@
+int f0(){return 3;}
+int f1(){int a=f0()+f0();return a*f0();}
+int f2(){int b=f1();int c=f1()-f0();return b*c+f1();}
+int f3(){int d=f2()/f1();return f2()-d;}
+int main(){int r=f3()+f2();return r;}
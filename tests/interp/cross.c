@@ -0,0 +1,3 @@
+int f(){int x=1;return x;}
+int g(){return x;}
+int main(){int a=f()+76;int r=g();return r+a;}
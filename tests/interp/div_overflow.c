@@ -0,0 +1,2 @@
+int m(){int a=0-2147483647-1;return a*a*2;}
+int main(){int b=m();int c=0-1;return b/c;}
@@ -0,0 +1 @@
+int main(){int a=5;int b=a-5;return a/b;}
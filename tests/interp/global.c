@@ -0,0 +1,4 @@
+int k=5;
+int h(){return 1;}
+int g(){return k;}
+int main(){int a=40;int r=g();return r+h();}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Every front-end mode must accept and reject exactly what the default
+# single pass does. ok_*.c have to compile and err_*.c must not; the
+# output of each mode is compared with the default's. --lazy leaves out
+# functions main does not reach, so only the ones it emits are compared,
+# and --stream writes the code before an error, so on err_*.c only the
+# errors are. --pipeline must write exactly what --stream writes.
+#
+#   tests/scope.sh [compiler]
+
+cc=${1:-./build/compiler}
+dir=$(dirname "$0")/scope
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+err='Parse error'
+
+# the functions named in $2, as file $1 emits them
+funcs() {
+	awk -v names="$2" 'BEGIN { split(names, n); for (i in n) f[n[i] "PRE:"] = 1 }
+		f[$0] { on = 1 } on { print } /POST:$/ { on = 0 }' "$1"
+}
+
+for f in "$dir"/*.c; do
+	name=$(basename "$f" .c)
+	"$cc" "$f" > "$tmp/want" 2>&1
+	case $name in
+	ok_*) if grep -q "$err" "$tmp/want"; then
+		echo "$name: rejected"; fail=1; fi ;;
+	err_*) if ! grep -q "$err" "$tmp/want"; then
+		echo "$name: accepted"; fail=1; fi ;;
+	esac
+	exact=
+	case $name in ok_*) exact=--stream ;; esac
+	for mode in $exact "--jobs 2" "--cache $tmp/cache" \
+			"--cache $tmp/cache" ast; do
+		if [ "$mode" = ast ]; then
+			"$cc" --emit-ast "$tmp/ast" "$f" > "$tmp/got" 2>&1
+			grep -q "$err" "$tmp/got" \
+				|| "$cc" --from-ast "$tmp/ast" > "$tmp/got" 2>&1
+		else
+			"$cc" $mode "$f" > "$tmp/got" 2>&1
+		fi
+		if ! cmp -s "$tmp/want" "$tmp/got"; then
+			echo "$name: $mode differs"; fail=1
+		fi
+	done
+	grep "$err" "$tmp/want" > "$tmp/want.err"
+	for mode in --lazy --stream; do
+		"$cc" $mode "$f" 2>&1 | grep "$err" > "$tmp/got.err"
+		if ! cmp -s "$tmp/want.err" "$tmp/got.err"; then
+			echo "$name: $mode differs"; fail=1
+		fi
+	done
+	"$cc" --stream "$f" > "$tmp/want" 2>&1
+	"$cc" --pipeline "$f" > "$tmp/got" 2>&1
+	if ! cmp -s "$tmp/want" "$tmp/got"; then
+		echo "$name: --pipeline differs from --stream"; fail=1
+	fi
+	case $name in ok_*)
+		"$cc" --lazy "$f" > "$tmp/lazy" 2>&1
+		names=$(sed -n 's/PRE:$//p' "$tmp/lazy")
+		funcs "$tmp/want" "$names" > "$tmp/want.fn"
+		funcs "$tmp/lazy" "$names" > "$tmp/got.fn"
+		if [ -z "$names" ] || ! cmp -s "$tmp/want.fn" "$tmp/got.fn"; then
+			echo "$name: --lazy functions differ"; fail=1
+		fi ;;
+	esac
+done
+
+# an error several token batches in, after code is already written
+i=0
+while [ $i -lt 2000 ]; do
+	echo "int f$i(){int a$i=$i;return a$i;}"
+	i=$((i + 1))
+done > "$tmp/late.c"
+echo "int main(){return x;}" >> "$tmp/late.c"
+"$cc" --stream "$tmp/late.c" > "$tmp/want" 2>&1
+"$cc" --pipeline "$tmp/late.c" > "$tmp/got" 2>&1
+if ! grep -q "$err" "$tmp/want" || ! cmp -s "$tmp/want" "$tmp/got"; then
+	echo "late error: --pipeline differs from --stream"; fail=1
+fi
+
+# a warm cache must not replay a body whose callee has moved below it
+rm -rf "$tmp/cache"
+printf 'int g(){return 1;}\nint f(){int a=g();return a;}\n%s\n' \
+	'int main(){return f();}' > "$tmp/edit.c"
+"$cc" --cache "$tmp/cache" "$tmp/edit.c" > /dev/null 2>&1
+printf 'int f(){int a=g();return a;}\nint g(){return 1;}\n%s\n' \
+	'int main(){return f();}' > "$tmp/edit.c"
+"$cc" "$tmp/edit.c" > "$tmp/want" 2>&1
+"$cc" --cache "$tmp/cache" "$tmp/edit.c" > "$tmp/got" 2>&1
+if ! grep -q "$err" "$tmp/got" || ! cmp -s "$tmp/want" "$tmp/got"; then
+	echo "edit: --cache replays a moved callee"; fail=1
+fi
+[ $fail = 0 ] && echo "scope OK"
+exit $fail
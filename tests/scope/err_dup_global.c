@@ -0,0 +1,3 @@
+int x = 1;
+int f(){int x=2;return x;}
+int main(){return f();}
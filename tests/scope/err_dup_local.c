@@ -0,0 +1,3 @@
+int f(){int x=1;return x;}
+int g(){int x=2;return x;}
+int main(){return f()+g();}
@@ -0,0 +1,2 @@
+int main(){return f();}
+int f(){return 1;}
@@ -0,0 +1,3 @@
+int f(){return x;}
+int x = 1;
+int main(){return f();}
@@ -0,0 +1,2 @@
+int g(){return x;}
+int main(){int x=1;return g();}
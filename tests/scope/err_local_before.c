@@ -0,0 +1 @@
+int main(){int y=x;int x=1;return y;}
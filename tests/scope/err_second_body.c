@@ -0,0 +1,3 @@
+int f(){return 1;}
+int g(){int a=f();return a+b;}
+int main(){return g()+h();}
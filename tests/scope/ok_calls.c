@@ -0,0 +1,4 @@
+int g = 4;
+int f(){int a=g*2;return a;}
+int h(){int b=f();return b+f();}
+int main(){return h();}
@@ -0,0 +1,3 @@
+int f(){int x=1;return x;}
+int g(){return x;}
+int main(){return g();}
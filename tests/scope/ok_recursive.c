@@ -0,0 +1,2 @@
+int f(){int a=1;return f();}
+int main(){int r=f();return r;}
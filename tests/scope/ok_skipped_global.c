@@ -0,0 +1,3 @@
+int k=5;
+int X(){int y=1+2;return y;}
+int main(){int m=k;return m;}
@@ -0,0 +1,2 @@
+int B(){int b=5;int c=7;return b;}
+int main(){int m=c;return m;}
@@ -0,0 +1,356 @@
+#include "comp.h"
+
+#define VM_REGS (1 << 22)
+#define VM_CALLS (1 << 16)
+#define VM_FRAME_MAX UINT16_MAX
+// the return address and saved %rbp between a caller's pushes and ours
+#define VM_LINK 2
+
+/*
+ * Bytecode interpreter. Each function is lowered to three-address code
+ * over a frame of 64-bit registers, one per stack slot the native code
+ * pushes, in the same order. A call's destination register is where
+ * the native call pushes its return address; the callee's frame starts
+ * VM_LINK slots further, where its first push lands, and it returns by
+ * writing the destination register.
+ *
+ * A read is placed as output_layout places it, by its distance from
+ * the top of the stack. Reads of locals land in the reader's frame;
+ * reads of other functions' locals and of globals reach up into the
+ * frames of its callers, as the native code does. Where native code
+ * finds a return address, a saved %rbp, or above the entry function
+ * whatever the C code calling it left, the interpreter has stale
+ * values or zeros, so programs that read those differ.
+ */
+
+enum vm_op {VM_CONST, VM_MOV, VM_LOAD, VM_ADD, VM_SUB, VM_MUL, VM_DIV,
+	VM_CALL, VM_RET};
+
+struct vm_ins {
+	uint16_t op;
+	uint16_t dst;
+	union {
+		struct {
+			uint16_t a;
+			uint16_t b;
+		};
+		int32_t imm; // VM_CONST, and the VM_LOAD and VM_RET slot
+		uint32_t func; // VM_CALL
+	};
+};
+
+struct vm_func {
+	uint32_t pc;
+	uint32_t regs;
+	uint32_t sym;
+};
+
+struct vm_frame {
+	struct vm_ins *ret;
+	int64_t *base;
+};
+
+VECTOR_DEFINE(vm_code, struct vm_ins)
+VECTOR_DEFINE(vm_funcs, struct vm_func)
+
+struct vm_prog {
+	struct vm_code code;
+	struct vm_funcs funcs;
+	int32_t *func_of; // symbol -> function, or -1
+	uint64_t stack; // as out_ctx->stack
+};
+
+void vm_err(const char* what, const char* name) {
+	fprintf(diag_stream(), "%s %s\n", what, name);
+	compile_fail();
+}
+
+void vm_emit(struct vm_prog *prog, enum vm_op op, uint32_t dst, uint16_t a,
+		uint16_t b) {
+	struct vm_ins ins = { .op = op, .dst = dst, .a = a, .b = b };
+	vm_code_push(&prog->code, ins);
+}
+
+void vm_emit_imm(struct vm_prog *prog, enum vm_op op, uint32_t dst,
+		int32_t imm) {
+	struct vm_ins ins = { .op = op, .dst = dst, .imm = imm };
+	vm_code_push(&prog->code, ins);
+}
+
+/*
+ * A read count bytes above the top of the stack, with depth slots
+ * pushed in this frame so far. Slots above the frame are negative.
+ */
+void vm_read(struct vm_prog *prog, uint32_t depth, uint64_t count) {
+	int64_t slot = (int64_t)depth - 1 - (int64_t)(count / 8);
+	if (slot >= 0)
+		vm_emit(prog, VM_MOV, depth, slot, 0);
+	else
+		vm_emit_imm(prog, VM_LOAD, depth,
+				slot < INT32_MIN ? INT32_MIN : slot);
+}
+
+/*
+ * Lowers the body of the function at node index fi. depth counts the
+ * slots pushed in this frame, while prog->stack goes on counting
+ * across the file exactly as in output_layout.
+ */
+void vm_lower_func(struct context *ctx, struct vm_prog *prog, uint32_t fi) {
+	struct ast_node *func = &ctx->ast->buff[fi], *node;
+	struct sym_ent *se = ctx->symbols->buff[func->sym];
+	struct vm_func *vf = &prog->funcs.buff[prog->func_of[func->sym]];
+	struct vm_ins ins;
+	uint32_t depth = 0, regs = 1;
+	vf->pc = prog->code.len;
+	for (uint32_t i = fi + 1; i < func->end; ++i) {
+		node = &ctx->ast->buff[i];
+		if (depth + 1 >= VM_FRAME_MAX)
+			vm_err("Function too large to interpret:", se->name);
+		switch (node->type) {
+			case AST_INT:
+				vm_emit_imm(prog, VM_CONST, depth, node->int_val);
+				break;
+			case AST_VAR:
+				vm_read(prog, depth, prog->stack
+						- ctx->symbols->buff[node->sym]->stack);
+				break;
+			case AST_ASS:
+				// the value it was given is pushed once more
+				ctx->symbols->buff[node->sym]->stack = prog->stack;
+				vm_emit(prog, VM_MOV, depth, depth - 1, 0);
+				break;
+			case AST_OP:
+				prog->stack -= 16;
+				depth -= 2;
+				switch (node->char_val) {
+					case '+':
+						vm_emit(prog, VM_ADD, depth, depth, depth + 1);
+						break;
+					case '-':
+						vm_emit(prog, VM_SUB, depth, depth, depth + 1);
+						break;
+					case '*':
+						vm_emit(prog, VM_MUL, depth, depth, depth + 1);
+						break;
+					case '/':
+						vm_emit(prog, VM_DIV, depth, depth, depth + 1);
+						break;
+					default:
+						vm_err("Unknown operator in", se->name);
+				}
+				break;
+			case AST_CALL:
+				if (prog->func_of[node->sym] < 0)
+					vm_err("Undefined function",
+							ctx->symbols->buff[node->sym]->name);
+				ins = (struct vm_ins){ .op = VM_CALL, .dst = depth,
+					.func = prog->func_of[node->sym] };
+				vm_code_push(&prog->code, ins);
+				break;
+			case AST_ARGS:
+				// arguments are never evaluated, as in out.c
+				i = node->end - 1;
+				continue;
+			case AST_SKIP:
+				continue;
+			default:
+				vm_err("Cannot interpret body of", se->name);
+		}
+		prog->stack += 8;
+		depth++;
+		if (depth > regs)
+			regs = depth;
+	}
+	// the native epilogue pops whatever was pushed last, in an empty
+	// function the saved %rbp
+	vm_emit_imm(prog, VM_RET, 0, (int32_t)depth - 1);
+	vf->regs = regs;
+}
+
+/*
+ * Functions are numbered first, so calls to ones defined further down
+ * resolve. Top-level code outside functions never runs natively, so
+ * it is not lowered, but its pushes are counted all the same.
+ */
+void vm_lower(struct context *ctx, struct vm_prog *prog) {
+	struct ast_pool *ast = ctx->ast;
+	struct ast_node *node;
+	struct vm_func vf = { 0 };
+	size_t nsyms = ctx->symbols->len;
+	prog->func_of = malloc((nsyms ? nsyms : 1) * sizeof(int32_t));
+	for (size_t i = 0; i < nsyms; ++i)
+		prog->func_of[i] = -1;
+	for (uint32_t i = 0; i < ast->len; ++i) {
+		if (ast->buff[i].type != AST_FUNC)
+			continue;
+		vf.sym = ast->buff[i].sym;
+		prog->func_of[vf.sym] = prog->funcs.len;
+		vm_funcs_push(&prog->funcs, vf);
+		i = ast->buff[i].end - 1;
+	}
+	for (uint32_t i = 0; i < ast->len; ++i) {
+		node = &ast->buff[i];
+		switch (node->type) {
+			case AST_FUNC:
+				vm_lower_func(ctx, prog, i);
+				i = node->end - 1;
+				continue;
+			case AST_OP:
+				prog->stack -= 16;
+				break;
+			case AST_ASS:
+				ctx->symbols->buff[node->sym]->stack = prog->stack;
+				break;
+			case AST_ARGS:
+				i = node->end - 1;
+				continue;
+			case AST_INT:
+			case AST_VAR:
+			case AST_CALL:
+				break;
+			default:
+				continue;
+		}
+		prog->stack += 8;
+	}
+}
+
+#define DISPATCH() goto *labels[(ip)->op]
+
+/*
+ * Threaded dispatch: every handler ends in a jump through the label
+ * table, so each opcode gets an indirect branch of its own. Arithmetic
+ * wraps like the 64-bit registers it stands in for.
+ */
+int vm_exec(struct vm_prog *prog, uint32_t entry, int64_t *result) {
+	static void* labels[] = { &&op_const, &&op_mov, &&op_load, &&op_add,
+		&&op_sub, &&op_mul, &&op_div, &&op_call, &&op_ret };
+	int64_t *regs = calloc(VM_REGS, sizeof(int64_t)), *end = regs + VM_REGS;
+	struct vm_frame *calls = malloc(VM_CALLS * sizeof(struct vm_frame));
+	struct vm_frame *fp = calls;
+	struct vm_ins *code = prog->code.buff, *ip;
+	struct vm_func *fn = &prog->funcs.buff[entry];
+	int64_t *r = regs + VM_LINK;
+	int64_t at;
+	int res = 0;
+	if (r + fn->regs > end)
+		goto overflow;
+	ip = code + fn->pc;
+	DISPATCH();
+op_const:
+	r[ip->dst] = ip->imm;
+	ip++;
+	DISPATCH();
+op_mov:
+	r[ip->dst] = r[ip->a];
+	ip++;
+	DISPATCH();
+op_load:
+	// above the entry function there is nothing of ours to read
+	at = (r - regs) + ip->imm;
+	r[ip->dst] = at >= 0 ? regs[at] : 0;
+	ip++;
+	DISPATCH();
+op_add:
+	r[ip->dst] = (uint64_t)r[ip->a] + (uint64_t)r[ip->b];
+	ip++;
+	DISPATCH();
+op_sub:
+	r[ip->dst] = (uint64_t)r[ip->a] - (uint64_t)r[ip->b];
+	ip++;
+	DISPATCH();
+op_mul:
+	r[ip->dst] = (uint64_t)r[ip->a] * (uint64_t)r[ip->b];
+	ip++;
+	DISPATCH();
+op_div:
+	// idivq faults on both of these
+	if (r[ip->b] == 0 || (r[ip->a] == INT64_MIN && r[ip->b] == -1)) {
+		fprintf(diag_stream(), "Arithmetic error in division\n");
+		res = -1;
+		goto done;
+	}
+	r[ip->dst] = r[ip->a] / r[ip->b];
+	ip++;
+	DISPATCH();
+op_call:
+	fn = &prog->funcs.buff[ip->func];
+	if (++fp == calls + VM_CALLS
+			|| r + ip->dst + VM_LINK + fn->regs > end)
+		goto overflow;
+	fp->ret = ip + 1;
+	fp->base = r;
+	r += ip->dst + VM_LINK;
+	ip = code + fn->pc;
+	DISPATCH();
+op_ret:
+	at = (r - regs) + ip->imm;
+	r[-VM_LINK] = at >= 0 ? regs[at] : 0;
+	if (fp == calls) {
+		*result = r[-VM_LINK];
+		goto done;
+	}
+	ip = fp->ret;
+	r = fp->base;
+	fp--;
+	DISPATCH();
+overflow:
+	fprintf(diag_stream(), "Interpreter stack overflow\n");
+	res = -1;
+done:
+	free(calls);
+	free(regs);
+	return res;
+}
+
+void vm_release(struct vm_prog *prog) {
+	free(prog->code.buff);
+	free(prog->funcs.buff);
+	free(prog->func_of);
+	free(prog);
+}
+
+/*
+ * Lowers the parsed program and runs the first --entry function,
+ * printing what it returns to diag like --run does.
+ */
+int vm_run(struct context *ctx, struct vm_prog *prog, struct options *opt,
+		FILE* diag) {
+	struct sym_ent *se;
+	int64_t result;
+	int32_t entry = -1;
+	vm_lower(ctx, prog);
+	for (size_t i = 0; i < prog->funcs.len && entry < 0; ++i) {
+		se = ctx->symbols->buff[prog->funcs.buff[i].sym];
+		if (!strcmp(se->name, opt->entries[0]))
+			entry = i;
+	}
+	if (entry < 0)
+		vm_err("No entry function", opt->entries[0]);
+	if (opt->stats)
+		fprintf(stderr, "vm     %12zu functions %12zu instructions\n",
+				prog->funcs.len, prog->code.len);
+	if (vm_exec(prog, entry, &result) == -1)
+		return -1;
+	fprintf(diag, "%d\n", (int)result);
+	return 0;
+}
+
+/*
+ * The front end runs in whichever mode the options pick. Nothing in
+ * this frame changes after setjmp, so a longjmp back finds it intact.
+ */
+int interp(struct context *ctx, FILE *fp, struct options *opt) {
+	struct compile_job job = { diag_stream() };
+	struct vm_prog *prog = calloc(1, sizeof(struct vm_prog));
+	int failed = 0;
+	cur_job = &job;
+	if (setjmp(job.bail) || front_end(ctx, fp, opt) == -1
+			|| vm_run(ctx, prog, opt, job.diag) == -1)
+		failed = 1;
+	cur_job = NULL;
+	if (ctx->parser)
+		parse_end(ctx);
+	vm_release(prog);
+	return failed;
+}